@@ -37,7 +37,10 @@ typedef struct methodTable
     MethodTableBucket buckets[0];
 } MethodTable;
 
-extern MethodTable *methodTableDataNew(Size size);
+#define methodTableDataSize(number)\
+    (sizeof(MethodTable) + sizeof(MethodTableBucket) * ((number) + ((number) >> 1)))
+
+extern MethodTable *methodTableDataInit(MethodTable *table, Size size);
 extern void methodTableDataAdd(MethodTable *table, Object *symbol, Object *method);
 extern Object *methodTableDataGet(MethodTable *table, Object *symbol);
 extern void methodTableDataDebug(MethodTable *table);
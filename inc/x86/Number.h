@@ -22,6 +22,17 @@
 #include <main.h>
 #include <vm.h>
 
+typedef struct rangeData
+{
+    Size start, stop, step;
+} RangeData;
+
+typedef struct rangeIterData
+{
+    Size pos;
+    Object *range;
+} RangeIterData;
+
 Object *numberProto, *integerProto, *integer32Proto, *integer64Proto;
 
 extern void numberInstall();
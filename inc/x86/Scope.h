@@ -35,10 +35,7 @@ typedef struct scope
     // parent scope (where this was declared) that we can look for variables in
 	Object *containing;
 	Object *caller; // scope that this scope was called from
-	/* The following data is for storage when executing a child scope */
-	Object *closure;
-	u8 *bytecode; // beginning of bytecode
-    Size IP; // index of bytecode
+	Object *closure; // the closure being run in this scope
 } Scope;
 
 Object *globalScope;
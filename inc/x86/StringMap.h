@@ -41,6 +41,7 @@ extern StringMap *stringMapNew();
 extern bool stringMapSet(StringMap *map, String key, void *value);
 extern void *stringMapGet(StringMap *map, String key);
 extern void stringMapDel(StringMap *map);
+extern void stringMapForEachValue(StringMap *map, void (*function)(void *));
 extern void stringMapDebug(StringMap *map);
 
 typedef struct
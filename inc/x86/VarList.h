@@ -52,11 +52,19 @@ typedef struct varList
     VarBucket buckets[0];
 } VarList;
 
+// bytes taken by a varList for capacity symbols
+#define varListSize(capacity)\
+    (sizeof(VarList) + sizeof(VarBucket) * ((capacity) + ((capacity) >> 1)))
+
 /* The symbols we want to create variables for must be specified at creation. */
 extern VarList *varListNew(Size capacity, void **symbols);
 extern VarList *varListNewPairs(Size capacity, void **symbols_and_values, Object *world);
+extern VarList *varListInitPairs(VarList *table, Size capacity,
+                                 void **symbols_and_values, Object *world);
 extern bool varListSet(VarList *table, Object *world, Object *var, Object *value);
 extern Object *varListGet(VarList *table, Object *var, Object **world_ptr);
 extern void varListCommit(VarList *table, Object *world);
+extern void varListDelItems(VarList *table);
+extern void varListDel(VarList *table);
 
 #endif
@@ -21,10 +21,14 @@
 #include <main.h>
 #include <threading.h>
 
+struct arena;
+
 /* This file includes some abstract data types for use in coding in the kernel.
  * These typically have both a Alloc/New and a Del/Free function associated
  * with them. Alloc and Free are unnecessary if using stack allocation,
- * otherwise all four should be used. */
+ * otherwise all four should be used. Those that take an arena allocate from
+ * it instead of the heap when it is not NULL; their Del and Free then do
+ * nothing, as the memory goes away with the arena. */
 
 ///////////////////////
 // General Functions //
@@ -45,9 +49,10 @@ typedef struct
 {
     Size count, capacity;
     String *table;
+    struct arena *arena;
 } InternTable;
 
-extern InternTable *internTableNew();
+extern InternTable *internTableNew(struct arena *arena);
 extern Size internString(InternTable *table, String string);
 extern void internTableDel(InternTable *table);
 extern bool isStringInterned(InternTable *table, String string);
@@ -85,10 +90,12 @@ typedef struct
 {
     Size capacity, size;
     String s;
+    struct arena *arena;
 } StringBuilder;
 
-extern StringBuilder *stringBuilderAlloc();
-extern StringBuilder *stringBuilderNew(StringBuilder *sb, String initial);
+extern StringBuilder *stringBuilderAlloc(struct arena *arena);
+extern StringBuilder *stringBuilderNew(StringBuilder *sb, String initial,
+                                       struct arena *arena);
 /* note: Del will destroy both the string builder and its contents */
 extern StringBuilder *stringBuilderDel(StringBuilder *sb);
 extern void stringBuilderFree(StringBuilder *sb);
@@ -0,0 +1,114 @@
+/*  Copyright (C) 2014 Xander Vedejas <xvedejas@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  Maintained by:
+ *      Xander Vedejas <xvedejas@gmail.com>
+ */
+#ifndef __gc_h__
+#define __gc_h__
+#include <main.h>
+#include <vm.h>
+
+/* VM objects are reclaimed by a precise, generational mark and sweep
+ * collector. Marking starts from the roots, and follows each object's parent
+ * and method table and whatever its data refers to (see ObjectKind). Every
+ * object left unmarked is then freed along with its data. The roots are:
+ * - the globals given to gcAddRoot(), which are the prototypes and other
+ *   well-known objects;
+ * - globalScope and every symbol in the symbol table;
+ * - the constant pool of every code unit loaded;
+ * - the values and scopes stacks of the running process, and the objects it
+ *   has pinned.
+ *
+ * The collector does not look at the C stack. Instead each object is pinned
+ * by its process when it is made, and stays pinned until the bytecode
+ * instruction that was running at the time is done: exec() unpins back to the
+ * depth it started at before each instruction, and pins the value it returns
+ * for its caller. A C method that keeps sending messages in a loop, like do:,
+ * unpins what each iteration made with gcUnpinTo(). An object that is neither
+ * new nor reachable from the roots must be pinned with gcPin() to be kept
+ * across anything that may allocate an object.
+ *
+ * Objects are bump allocated from the nursery, a list of chunks of
+ * gcChunkSize bytes that are aligned to their size. Payloads of up to
+ * gcMaxInlineData bytes are placed right after their object. Once
+ * gcNurseryChunks chunks are full, a minor collection marks only the young
+ * objects, starting from the roots and from the old objects in the remembered
+ * set. Since C code holds objects in its locals, survivors are not moved: a
+ * chunk in which any object survived is promoted whole to the old generation,
+ * and a chunk in which none did is reused as it is. A chunk of the old
+ * generation is freed once every object in it is dead.
+ *
+ * Any store of a young object into an old one must go through
+ * gcWriteBarrier(), which adds the old object to the remembered set. Objects
+ * are never written to after they are made except through scope_setVar(),
+ * methodTable_addClosure() and a few others, so there are only a few such
+ * stores.
+ *
+ * A major collection marks everything, and happens instead of a minor one once
+ * as many objects have been promoted since the last major collection as
+ * survived it, and at least gcMinimumInterval. There is no collection while
+ * another thread has a process, since that thread may be stopped halfway
+ * through an instruction; the nursery grows instead, and a collection is only
+ * tried again once it has grown by another gcNurseryChunks chunks. */
+#define gcMinimumInterval 1024
+#define gcMarkStackSize 1024
+#define gcMaxRoots 64
+#define gcChunkSize 0x4000
+#define gcNurseryChunks 16
+#define gcSpareChunks 16 // chunks kept for the nursery when they are freed
+#define gcMaxRemembered 1024
+#define gcMaxInlineData 256
+
+// in Object.flags
+#define objectMarked bit(0) // only during a collection
+#define objectYoung bit(1)
+#define objectRemembered bit(2)
+#define objectAllocated bit(3) // until the collector frees it
+
+#define gcChunkMagic 0x0B1EC75
+
+typedef struct gcChunk
+{
+    u32 magic; // gcChunkMagic while the chunk holds objects
+    struct gcChunk *next;
+    Size live; // number of objects that survived, in the old generation
+    u8 *top, *end; // free space
+    u8 start[0];
+} GCChunk;
+
+#define gcChunkOf(ptr) ((GCChunk*)((Size)(ptr) & ~(gcChunkSize - 1)))
+
+#define gcWriteBarrier(holder, value)\
+({\
+    Object *_value = (value);\
+    if (_value != NULL && !isSmallInteger(_value) &&\
+        (_value->flags & objectYoung) &&\
+        !((holder)->flags & (objectYoung | objectRemembered)))\
+        gcRemember(holder);\
+})
+
+extern void gcInstall();
+extern void gcAddRoot(Object **root);
+extern Object *gcAllocObject(Size dataSize);
+extern void gcRemember(Object *object);
+extern bool gcDoomed(Object *object);
+extern bool gcIsObject(void *ptr);
+extern void gcPin(Object *object);
+extern Size gcPinDepth();
+extern void gcUnpinTo(Size depth);
+extern void gcCollect();
+
+#endif
@@ -63,8 +63,10 @@ typedef struct token
     Size line, col, start, end;
 } Token;
 
-extern void tokenDel(Token *token);
-extern Token *lex(String source, Size lastTokenEnd, Token *lastToken);
+struct arena;
+
+extern Token *lex(String source, Size lastTokenEnd, Token *lastToken,
+                  struct arena *arena);
 extern void testLexer(String source);
 
 #endif
@@ -76,6 +76,7 @@ extern void outws(u16 port, u16 *data, Size size);
 extern u32 ind(u16 port);
 extern void outd(u16 port, u32 data);
 extern void outl(u32 port, u32 data);
+extern umax rdtsc();
 
 extern void printf(const char *format, ...);
 extern void sprintf(char *strBuffer, const char *format, ...);
@@ -81,21 +81,194 @@ struct multibootStructure
 
 typedef struct multibootStructure MultibootStructure;
 
+/* All usable memory is handed out a page at a time by a binary buddy
+ * allocator: a free block of 2^order pages starts on a multiple of 2^order
+ * pages, and is merged with its "buddy", the other half of the block of twice
+ * its size, when that is free too. Allocations of at least mmLargeThreshold
+ * bytes are large blocks: they take a buddy block of their own and give back
+ * the pages of it past the last one they need, so they waste less than a page
+ * each. Everything else comes from the heap and the slabs, which take whole
+ * buddy blocks as they need more memory, so large blocks never splinter the
+ * small-object heap.
+ *
+ * There is a Page for every page from the lowest to the highest usable one.
+ * Only the first page of a buddy block says what the block is. */
+#define mmPageSize ((Size)0x1000)
+#define mmPageShift 12
+#define mmBuddyOrderCount 16 // the largest blocks are 2^15 pages, 128 MiB
+#define mmLargeThreshold (4 * mmPageSize) // below this, the heap wastes less
+#define mmHeapGrowOrder 4 // the heap grows by at least 16 pages at a time
+
+typedef enum
+{
+    pageReserved, // not usable memory
+    pageHeap, // part of a region of the heap
+    pageSlab,
+    pageFree, // first page of a free buddy block
+    pageLarge, // first page of a buddy block handed out by _kalloc()
+    pageTail, // any other page of a buddy block
+} PageType;
+
+typedef struct page
+{
+    u8 type : 7; // PageType
+    /* Of a page of a free buddy block: the page holds nothing but zeros. Only
+     * meaningful while the page is free; it is cleared when used memory is
+     * given back to the buddy allocator. */
+    u8 zeroed : 1;
+    u8 order;
+    u16 profileSite; // of a large block, see mmProfileDump()
+    u16 length; // of a large block, in pages
+    struct thread *thread; // owner of a large block
+    /* A free block is in the free list for its order, and a large block with
+     * an owning thread is in the thread's list of owned pages */
+    struct page *previous, *next;
+} Page;
+
+/* Every block of heap memory starts with a MemoryHeader. Blocks are laid out
+ * back to back, with a used "fence" header of size zero closing off the end of
+ * each region of memory, so the block physically after a header is always at
+ * header->start + header->size. Free blocks also end with a pointer back to
+ * their header (a boundary tag), which together with previousFree lets us
+ * find the block physically before a header too.
+ *
+ * In a release build the header is only two words. The free list links of a
+ * free block live in its first payload words (see FreeLinks in mm.c) and the
+ * profiling site of a used block lives in its last word. A used block with an
+ * owning thread is two words bigger, and links it into the thread's list of
+ * owned blocks from just before the profiling site, so that freeThread() need
+ * not walk the heap. So a block from kalloc(..., NULL) costs 8 bytes besides
+ * its payload, but one from malloc() costs 16. Allocations small enough for
+ * the slabs cost neither. */
 typedef struct memoryHeader
 {
+    #ifndef __release__
     u32 startMagic;
-    void *memoryBlockStart;
-    Size size;
+    #endif
+    Size size : 30;
+    Size free : 1;
+    Size previousFree : 1; // is the block physically before this one free?
     struct thread *thread;
-    bool free;
-    struct memoryHeader *previous, *next;
+    #ifndef __release__
     u32 endMagic;
+    #endif
     Size start[0];
 } MemoryHeader;
 
+/* Small allocations (up to slabMaxObjectSize bytes) do not get a MemoryHeader
+ * of their own. Instead they are carved out of slabs: page-aligned pages which
+ * hold objects of a single size class. Each slab belongs to the thread its
+ * objects were allocated for, so that freeThread() can release a dying
+ * thread's small allocations a page at a time. */
+#define slabPageSize mmPageSize
+#define slabMaxObjectSize 256
+#define slabSizeClassCount 11
+#define slabMaxObjects 512
+
+typedef struct slab
+{
+    u32 magic;
+    u16 sizeClass; // index into slabSizeClasses
+    u16 capacity; // number of objects that fit in this slab
+    u16 inUse; // number of objects currently allocated
+    u16 unused; // objects at index >= unused have never been handed out
+    void *freeList; // singly linked through the first word of free objects
+    struct thread *thread;
+    struct slab *previous, *next;
+    u16 *sites; // allocation site of each object, only while profiling
+    u32 allocated[slabMaxObjects / 32]; // one bit per object
+} Slab;
+
+/* Each thread keeps a magazine of free objects per size class, taken from
+ * and given back to its own slabs a batch at a time. A thread allocating or
+ * freeing its own small objects only needs mmLockMutex to refill or drain a
+ * magazine. Objects in a magazine start with a tag word, so that a double
+ * free is caught without searching the magazine. */
+#define slabMagazineSize 32
+#define slabMagazineBatch 16
+
+/* Every thread has one of these, as does the kernel (for NULL-thread
+ * allocations). "partial" slabs still have room, "full" slabs do not. The
+ * magazines are only used for a thread's allocations made by that thread.
+ * allocations and frees count the calls served from the magazines since they
+ * were last added to the allocator statistics, which is done with
+ * mmLockMutex held whenever a magazine is filled or drained. */
+typedef struct slabCache
+{
+    Slab *partial[slabSizeClassCount];
+    Slab *full[slabSizeClassCount];
+    Size magazineCount[slabSizeClassCount];
+    void *magazine[slabSizeClassCount][slabMagazineSize];
+    Size allocations, frees;
+} SlabCache;
+
+/* How much of the heap is checked for corruption on each allocation, free or
+ * realloc. Full verification walks the free lists and every heap region each
+ * time, which makes every call O(heap); sampled verification checks
+ * mmVerifySampleSize free blocks per call, carrying on where the last call
+ * left off, and checks the headers of the blocks being touched. The level can
+ * be overridden with mmverify=off, mmverify=sampled or mmverify=full on the
+ * kernel command line. sweep() always checks the whole heap. */
+typedef enum
+{
+    mmVerifyOff,
+    mmVerifySampled,
+    mmVerifyFull,
+} MMVerifyLevel;
+
+#ifndef mmDefaultVerifyLevel
+#ifdef __release__
+#define mmDefaultVerifyLevel mmVerifySampled
+#else
+#define mmDefaultVerifyLevel mmVerifyFull
+#endif
+#endif
+#define mmVerifySampleSize 4
+
+extern MMVerifyLevel mmVerifyLevel;
+
+/* Running totals kept by the allocator, so that they can be read without
+ * walking the heap. Byte and block counts are for heap blocks, large blocks
+ * and slab pages in use, and for free heap blocks and free buddy blocks. A
+ * slab page counts as a used block from when the slabs take it until it is
+ * given back to the buddy allocator, even while it holds no objects.
+ * allocations and frees count every call, small ones included. Free heap
+ * blocks are kept in one list per power of two, and histogram[i] is the
+ * number of free heap and buddy blocks of at least 2^i and less than
+ * 2^(i + 1) bytes. largestFree is the larger of the biggest block in the
+ * highest heap list that is not empty, so only that list is walked, and a
+ * block of the highest buddy order that has one free. */
+#define mmFreeListCount 32
+
+typedef struct
+{
+    Size usedBytes, freeBytes;
+    Size usedBlocks, freeBlocks;
+    Size largestFree;
+    Size allocations, frees;
+    Size histogram[mmFreeListCount];
+} MMStats;
+
+/* mmMaintain() never returns. It is run by an idle-priority thread, and does
+ * the allocator's housekeeping in time that would otherwise be spent halting:
+ * - threads that have ended are freed (see reapThreads()), since schedule()
+ *   runs in the timer interrupt and so cannot take mmLockMutex;
+ * - free buddy pages are zeroed, up to 2^mmZeroOrder pages at a time and with
+ *   mmLockMutex released, so that _calloc() of a large block only has to
+ *   clear the pages it was not yet done for;
+ * - heap regions that have become one free block, and free slab pages beyond
+ *   mmSlabPageReserve, are given back to the buddy allocator, where they merge
+ *   with their buddies again;
+ * - sweep() is run about once a second, unless mmverify=off. */
+#define mmZeroOrder 4
+#define mmZeroScanPages 1024 // Pages looked at per step while finding work
+#define mmSlabPageReserve 16
+
+extern void mmMaintain();
 extern void sweep();
 extern Size memUsed();
 extern Size memFree();
+extern void mmStats(MMStats *stats);
 extern void mmInstall(MultibootStructure *multiboot);
 
 /* malloc() will allocate memory then identify the allocated memory with the
@@ -106,18 +279,78 @@ extern void mmInstall(MultibootStructure *multiboot);
 #define kalloc(_size, _thread) _kalloc(_size, _thread, __FILE__, __LINE__, 1)
 #define aalloc(_size, _align) _kalloc(_size, getCurrentThread(), __FILE__, __LINE__, _align)
 #define free(_mem) _free(_mem, __FILE__, __LINE__)
+#define calloc(_amount, _elementSize) \
+    _calloc(_amount, _elementSize, __FILE__, __LINE__)
+#define realloc(_mem, _size) _realloc(_mem, _size, __FILE__, __LINE__)
+
+/* dmaAlloc() gives physically contiguous memory below a device's addressing
+ * limit, which is the highest physical address the device can reach. */
+#define mmDmaLimitIsa ((Size)0x00FFFFFF) // ISA DMA only reaches the low 16 MiB
+#define mmDmaLimit32 ((Size)0xFFFFFFFF) // 32-bit PCI bus masters
+#define dmaAlloc(_size, _align, _limit) \
+    _dmaAlloc(_size, _align, _limit, __FILE__, __LINE__)
 
 extern bool alloc(Size address, Size size);
+extern void *_dmaAlloc(Size size, Size alignment, Size limit, char *file,
+                       Size line);
 extern void *_kalloc(Size size, struct thread *thread, char *file, Size line,
                      Size alignment);
-extern void *calloc(Size amount, Size elementSize);
+extern void *_calloc(Size amount, Size elementSize, char *file, Size line);
 extern bool isAllocated(void *memory);
 extern void _free(void *memory, char *file, Size line);
-extern void *realloc(void *memory, Size size);
+extern void *_realloc(void *memory, Size size, char *file, Size line);
 extern void meminfo();
 extern void freeThread(struct thread *thread);
 /* Given a pointer to allocated memory, find the size of the allocated block.
  * Returns zero if given a pointer that does not point to allocated memory. */
 extern Size memBlockSize(void *memptr);
 
+/* With mmprofile on the kernel command line, every allocation is counted
+ * against its call site, the file and line given to _kalloc(). Sizes are
+ * block sizes, so they include rounding. mmProfileDump() prints a line per
+ * site with the number of allocations, the bytes allocated in total, the
+ * bytes still live and the most ever live at once:
+ *     mmprofile,<file>,<line>,<count>,<bytes>,<live>,<peak>
+ * mmProfileDumpThread() prints the live bytes a thread holds per site:
+ *     mmprofile-thread,<thread>,<file>,<line>,<live>
+ * Threads do not use their magazines while profiling. */
+#define mmProfileSiteCount 512
+
+typedef struct
+{
+    char *file;
+    Size line;
+    Size count, bytes, live, peak;
+} MMProfileSite;
+
+extern bool mmProfiling;
+extern void mmProfileDump();
+extern void mmProfileDumpThread(struct thread *thread);
+
+/* An arena hands out memory by bumping a pointer through large chunks taken
+ * from the heap. Nothing allocated from an arena is freed on its own:
+ * arenaReset() makes all of the arena's memory available again, and
+ * arenaDel() gives it back to the heap. This suits data that all dies at
+ * once, like everything the compiler builds while compiling some source. */
+typedef struct arenaChunk
+{
+    struct arenaChunk *next;
+    Size size, used;
+    u8 data[0];
+} ArenaChunk;
+
+typedef struct arena
+{
+    ArenaChunk *first, *current;
+    Size chunkSize;
+} Arena;
+
+extern Arena *arenaNew(Size chunkSize);
+extern void *arenaAlloc(Arena *arena, Size size);
+/* Grows memory in place if it was the last thing allocated from the arena,
+ * otherwise copies oldSize bytes of it somewhere new. */
+extern void *arenaRealloc(Arena *arena, void *memory, Size oldSize, Size size);
+extern void arenaReset(Arena *arena);
+extern void arenaDel(Arena *arena);
+
 #endif
@@ -8,6 +8,7 @@ typedef struct
     u32 interrupt;   // Interrupt used by device
     u16 baseAddress; // Typically the address of first port used
     u16 deviceID;
+    u8 *rxBuffer;    // Ring the card writes received packets into
 } NetworkInterfaceController;
 
 /* We make the assumption that there can be at most one NIC per interrupt
@@ -19,16 +19,20 @@
 #include <lexer.h>
 #include <vm.h>
 
+/* The bytecode compile() makes starts with a header of two tables: the symbol
+ * table, [symbol count] (name null)*, and the constant pool, [constant count]
+ * (integerBC digits null | stringBC text null)*. Bytecodes refer to symbols
+ * and to integer and string literals by their index in these. */
 extern u8 *compile(String source);
 extern const Size maxKeywordCount;
 
 typedef enum
 {
-    integerBC  = 0x81, // create integer object (convert from string; next n bytes until null)
+    integerBC  = 0x81, // push integer (next byte(s) index the constant pool)
     doubleBC   = 0x82, // create double object (convert from string; next n bytes until null)
-    stringBC   = 0x83, // create string object (next n bytes until null)
+    stringBC   = 0x83, // push string (next byte(s) index the constant pool)
     charBC     = 0x84, // create character object (next byte)
-    symbolBC   = 0x85, // create symbol object (next n bytes until null)
+    symbolBC   = 0x85, // push symbol (next byte(s) index the symbol table)
     arrayBC    = 0x86, // create array object (next byte tells how many elements to pop from stack)
     blockBC    = 0x87, /* create block object
                        * next byte tells how many arguments. Byte after that
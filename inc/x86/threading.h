@@ -81,6 +81,18 @@ typedef struct thread
     struct thread *waitingNext;
     /* The corresponding process in the vm, if any (else NULL) */
     struct object *process;
+    /* Slabs holding this thread's small allocations, created by the memory
+     * manager on first use (see mm.h) */
+    struct slabCache *slabCache;
+    /* Large blocks and heap blocks allocated to this thread, so that they can
+     * be freed when the thread ends (see mm.h) */
+    struct page *ownedPages;
+    struct memoryHeader *ownedBlocks;
+    /* Idle priority threads are only switched to when no other thread is
+     * ready or running */
+    bool idle;
+    /* Once the thread has ended, the next thread waiting to be freed */
+    struct thread *deadNext;
 } Thread;
 
 Thread *currentThread;
@@ -96,6 +108,7 @@ void sleep(u32 milliseconds);
 void threadsDebug();
 bool threadExists(Thread *thread);
 void threadPromote(Thread *thread);
+bool reapThreads();
 extern inline void leaveThread(); // give up control, idle
 
 ///////////////////////////////////////////////////////////////////////////////
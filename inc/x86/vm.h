@@ -39,6 +39,31 @@ typedef enum
     userDefinedClosure
 } closureType;
 
+/* The bytecode compile() makes is decoded once, when it is loaded, into an
+ * array of instructions of a fixed width whose operands are ready to use: the
+ * symbols they name, the objects made for their literals, and where the body
+ * of a block ends. exec() runs these and never reads the bytecode itself. */
+typedef struct instruction
+{
+    u8 opcode; // as in the bytecode
+    Size count; // arguments of a messageBC or blockBC, elements of an arrayBC
+    union
+    {
+        Object *literal; // integerBC, stringBC, symbolBC
+        Object *symbol; // variableBC, setBC, messageBC
+        Object **variables; // blockBC: symbols of its arguments, then its vars
+    };
+    union
+    {
+        struct inlineCache *cache; // messageBC
+        struct // blockBC
+        {
+            struct instruction *end; // the instruction after its endBC
+            Size varCount;
+        };
+    };
+} Instruction;
+
 typedef struct closure
 {
     closureType type;
@@ -51,7 +76,8 @@ typedef struct closure
         };
         struct // userDefinedClosure
         {
-            u8 *bytecode;
+            Instruction *code; // its blockBC instruction
+            struct code *unit; // the code unit holding it, which it uses
             /* The "parent" is the _scope_ in which this closure was defined */ 
             Object *parent;
             Object *world;
@@ -70,8 +96,34 @@ typedef struct trait
 
 typedef struct scope Scope;
 typedef struct process Process;
+typedef struct code Code;
 typedef struct world World;
 
+/* What an object's data points to, so that the collector knows what it has to
+ * trace and free (see gc.h) */
+typedef enum
+{
+    plainObject, // data is NULL
+    methodTableObject,
+    symbolObject,
+    closureObject,
+    stringObject,
+    arrayObject,
+    arrayIterObject,
+    integer32Object,
+    integer64Object,
+    rangeObject,
+    rangeIterObject,
+    scopeObject,
+    worldObject,
+    processObject,
+} ObjectKind;
+
+/* Objects come from the collector's nursery, usually with the data they own
+ * right after them (see object_newWithData()); larger data comes from
+ * kalloc(size, NULL). Either way the collector decides when they die, not the
+ * thread that made them. The exception is a process's data, which goes with
+ * its thread. */
 struct object
 {
     struct object *parent;
@@ -90,27 +142,74 @@ struct object
         World *world;
         char *symbol;
     };
+    struct object *nextObject; // in the collector's list of every object
+    u16 kind; // ObjectKind
+    u16 flags;
 };
 
+/* Integers that fit in 31 bits are never allocated. Instead the object
+ * pointer holds the value shifted left by one, with the low bit set, which no
+ * real object pointer has. Such a SmallInteger behaves just like an
+ * Integer32 made from integer32Proto, but has no memory behind it, so nothing
+ * may read its fields: use isSmallInteger() first wherever the object might be
+ * an integer. */
+#define isSmallInteger(obj) ((Size)(obj) & 1)
+#define smallIntegerNew(value) ((Object*)(((Size)(s32)(value) << 1) | 1))
+#define smallIntegerValue(obj) ((s32)(Size)(obj) >> 1)
+#define smallIntegerMin (-0x40000000)
+#define smallIntegerMax 0x3FFFFFFF
+
 typedef struct process
 {
 	Object *parent; // parent process
     Stack values; // stack for saving values during statement execution
     Stack scopes; // the "current scope" is the top of the stack
-    Object **symbols; // array of symbols (for de-interning)
-    u8 *bytecode; // beginning of bytecode
-    Size IP; // index of bytecode
+    Stack pinned; // objects C code may still be using (see gc.h)
+    Code *code; // the code unit being run
+    Instruction *IP; // the block instruction a closure is being made for
 } Process;
 
+/* A code unit is all the bytecode given to interpretBytecode() at once, as
+ * decoded by codeLoad(). It is freed once interpretBytecode() is done with it
+ * and every closure made from it has been collected. Until then, the objects
+ * of its constant pool are roots for the collector. */
+typedef struct code
+{
+    struct code *next; // in the list of every code unit loaded
+    Size users; // closures made from it, and interpretBytecode() while running
+    Size instructionCount;
+    Instruction *instructions;
+    Size constantCount;
+    Object **constants; // its constant pool (see compile())
+    Size cacheCount;
+    struct inlineCache *caches; // one for each messageBC
+    Size variableCount;
+    Object **variables; // what each blockBC's variables point into
+} Code;
+
 #define symbol(str) (symbol_new(symbolProto, str))
 
+/* The symbol for a string literal, found in the symbol table only the first
+ * time this line runs and kept in a static after that. Symbols are never
+ * collected, so the pointer stays good. Never give it a string that can
+ * change. */
+#define staticSymbol(str)\
+({\
+    static Object *_symbol = NULL;\
+    if (unlikely(_symbol == NULL))\
+        _symbol = symbol(str);\
+    _symbol;\
+})
+
 Object *objectProto, *objectMT, *symbolProto, *methodTableMT, *varTableProto,
     *closureProto, *scopeProto, *bindSymbol, *getSymbol, *trueObject,
-    *falseObject, *newSymbol, *DNUSymbol, *worldProto, *console;
+    *falseObject, *newSymbol, *DNUSymbol, *worldProto, *console, *memoryObject,
+    *interpreterObject;
 
 extern Object *symbol_new(Object *self, String string);
 extern Object *newDisallowed(Object *self);
 extern Object *object_new(Object *self);
+extern Object *object_newWithData(Object *self, Size dataSize);
 extern Object *object_bind(Object *self, Object *symbol);
 extern void vmInstall();
 extern void methodTable_addClosure(Object *self, Object *symbol, Object *closure);
@@ -120,6 +219,14 @@ extern Object *returnFalse(Object *self);
 extern Object *closure_with(Object *self, ...);
 extern Object *methodTable_new(Object *self, u32 size);
 extern Object *currentProcess();
+extern Object *process_new(Object *self);
+extern void methodCachePurge();
+extern bool vmTrace;
+extern umax vmInstructions;
+extern Code *loadedCode;
+extern Code *codeLoad(u8 *bytecode);
+extern void codeDel(Code *code);
+extern void codeRelease(Code *code);
 extern Object *interpret();
 extern void interpretBytecode(u8 *bytecode);
 
@@ -131,7 +238,7 @@ extern void interpretBytecode(u8 *bytecode);
 	if (method == NULL)\
 	{\
 		doesNotUnderstand = true;\
-		method = object_bind(self, symbol("doesNotUnderstand:"));\
+		method = object_bind(self, DNUSymbol);\
 		assert(method != NULL, "does not understand does not understand...\n");\
 		;\
 	}\
@@ -139,8 +246,9 @@ extern void interpretBytecode(u8 *bytecode);
 	closure_with(method, self, ## __VA_ARGS__);\
 })
 
+// messagestr must be a string literal
 #define send(obj, messagestr, ...)\
-    object_send(obj, symbol(messagestr), ## __VA_ARGS__)
+    object_send(obj, staticSymbol(messagestr), ## __VA_ARGS__)
 
 #define as(obj, T) ((T*)(obj)->data)
 
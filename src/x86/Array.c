@@ -24,6 +24,7 @@
 #include <Array.h>
 #include <data.h>
 #include <mm.h>
+#include <gc.h>
 
 Object *arrayIterProto;
 
@@ -50,9 +51,13 @@ Object *sequence_map(Object *self, Object *block)
 Object *sequence_do(Object *self, Object *block)
 {
     Object *iterator = send(self, "iter");
+    Size pinDepth = gcPinDepth();
     Object *item;
     while ((item = send(iterator, "next")) != NULL)
+    {
         send(block, ":", item);
+        gcUnpinTo(pinDepth);
+    }
     return NULL;
 }
 
@@ -77,13 +82,14 @@ Object *sequence_do(Object *self, Object *block)
 
 Object *array_new(Object *self, Object **objects, Size length)
 {
-    Object *array = object_new(self);
-    ArrayData *data = malloc(sizeof(ArrayData) + sizeof(Object*) * length);
+    Object *array = object_newWithData(self,
+        sizeof(ArrayData) + sizeof(Object*) * length);
+    ArrayData *data = array->array;
     Size i;
     for (i = 0; i < length; i++)
         data->objects[i] = objects[i];
     data->len = length;
-    array->data = data;
+    array->kind = arrayObject;
     return array;
 }
 
@@ -114,11 +120,11 @@ Object *sequence_toString(Object *self)
 /* the array iterator object points at the next index to read. */
 Object *array_iter(Object *self, Object *array)
 {
-    Object *iter = object_new(arrayIterProto);
-    ArrayIterData *data = malloc(sizeof(ArrayIterData));
+    Object *iter = object_newWithData(arrayIterProto, sizeof(ArrayIterData));
+    ArrayIterData *data = iter->data;
     data->pos = 0;
     data->array = self;
-    iter->data = data;
+    iter->kind = arrayIterObject;
     return iter;
 }
 
@@ -133,6 +139,11 @@ Object *arrayIter_next(Object *self)
 
 void arrayInstall()
 {
+    gcAddRoot(&sequenceProto);
+    gcAddRoot(&arrayProto);
+    gcAddRoot(&iterProto);
+    gcAddRoot(&arrayIterProto);
+    
 	Object *sequenceMT = methodTable_new(methodTableMT, 4);
 	sequenceProto = object_new(objectProto);
     sequenceProto->methodTable = sequenceMT;
@@ -21,11 +21,10 @@
 #include <vm.h>
 #include <cstring.h>
 
-MethodTable *methodTableDataNew(Size number)
+/* table must be methodTableDataSize(number) bytes */
+MethodTable *methodTableDataInit(MethodTable *table, Size number)
 {
     Size buckets = number + (number >> 1);
-    MethodTable *table = malloc(sizeof(MethodTable) +
-        sizeof(MethodTableBucket) * buckets);
     table->capacity = number;
     table->entries = 0;
     memset(table->buckets, 0, sizeof(MethodTableBucket) * buckets);
@@ -24,30 +24,36 @@
 #include <cstring.h>
 #include <mm.h>
 #include <Array.h>
+#include <gc.h>
 
-#define value32(obj) (*((u32*)obj->data))
+#define value32(obj) (isSmallInteger(obj) ? smallIntegerValue(obj) :\
+                                            *((s32*)(obj)->data))
 
 Object *integer32_new(Object *self, s32 value)
 {
-    Object *new = object_send(self, symbol("new"));
-    s32 *numberData = malloc(sizeof(s32));
-    new->data = numberData;
+    if (likely(self == integer32Proto && value >= smallIntegerMin &&
+               value <= smallIntegerMax))
+        return smallIntegerNew(value);
+    Object *new = object_newWithData(self, sizeof(s32));
+    s32 *numberData = new->data;
+    new->kind = integer32Object;
     numberData[0] = (Size)value;
     return new;
 }
 
 Object *integer64_new(Object *self, s64 value)
 {
-    Object *new = object_send(self, symbol("new"));
-    s64 *numberData = malloc(sizeof(s64));
-    new->data = numberData;
+    Object *new = object_newWithData(self, sizeof(s64));
+    s64 *numberData = new->data;
+    new->kind = integer64Object;
     numberData[0] = value;
     return new;
 }
 
 Object *integer32_add(Object *self, Object *other)
 {
-    printf("Adding %i and %i", value32(self), value32(other));
+	if (unlikely(vmTrace))
+		printf("Adding %i and %i\n", value32(self), value32(other));
 	return integer32_new(integer32Proto, value32(self) + value32(other));
 	/// todo: check for overflow
 }
@@ -60,7 +66,8 @@ Object *integer32_sub(Object *self, Object *other)
 
 Object *integer32_mul(Object *self, Object *other)
 {
-    printf("Multiplying %i and %i", value32(self), value32(other));
+	if (unlikely(vmTrace))
+		printf("Multiplying %i and %i\n", value32(self), value32(other));
 	return integer32_new(integer32Proto, value32(self) * value32(other));
 	/// todo: check for overflow
 }
@@ -113,39 +120,28 @@ Object *integer32_toString(Object *self)
 	return string_new(stringProto, strdup(strBuffer));
 }
 
-typedef struct rangeData
-{
-    Size start, stop, step;
-} RangeData;
-
-typedef struct rangeIterData
-{
-    Size pos;
-    Object *range;
-} RangeIterData;
-
 Object *rangeProto, *rangeIterProto;
 
 Object *integer32_to(Object *self, Object *end)
 {
     /* This method creates an integer range object which can be iterated through */
-    Object *range = object_new(rangeProto);
-    RangeData *data = malloc(sizeof(RangeData));
+    Object *range = object_newWithData(rangeProto, sizeof(RangeData));
+    RangeData *data = range->data;
     data->start = value32(self);
     data->stop = value32(end);
     data->step = 1;
-    range->data = data;
+    range->kind = rangeObject;
     return range;
 }
 
 Object *range_iter(Object *self)
 {
-    Object *iter = object_new(rangeIterProto);
-    RangeIterData *data = malloc(sizeof(RangeIterData));
+    Object *iter = object_newWithData(rangeIterProto, sizeof(RangeIterData));
+    RangeIterData *data = iter->data;
     RangeData *range = self->data;
     data->pos = range->start;
     data->range = self;
-    iter->data = data;
+    iter->kind = rangeIterObject;
     return iter;
 }
 
@@ -162,6 +158,13 @@ Object *rangeIter_next(Object *self)
 
 void numberInstall()
 {
+    gcAddRoot(&numberProto);
+    gcAddRoot(&integerProto);
+    gcAddRoot(&integer32Proto);
+    gcAddRoot(&integer64Proto);
+    gcAddRoot(&rangeProto);
+    gcAddRoot(&rangeIterProto);
+    
     numberProto = send(objectProto, "new");
     
     /* integerProto */
@@ -21,6 +21,7 @@
 #include <ObjectSet.h>
 #include <mm.h>
 #include <vm.h>
+#include <cstring.h>
 
 /* We begin with table A, and table B is NULL. When A gets nearly full (~75%),
  * we create a new bucket B that is larger. When inserting to the Set, we
@@ -38,13 +39,14 @@ const Size objectSetInitialSize = 5;
 
 ObjectSet *objectSetNew(Size initialSize)
 {
-    ObjectSet *set = malloc(sizeof(ObjectSet));
+    ObjectSet *set = kalloc(sizeof(ObjectSet), NULL);
     sweep();
     set->sizeA = max(initialSize, objectSetInitialSize);
     set->sizeB = 0;
     set->entriesA = 0;
     set->entriesB = 0;
-    set->A = calloc(sizeof(ObjectSetBucket), set->sizeA);
+    set->A = kalloc(sizeof(ObjectSetBucket) * set->sizeA, NULL);
+    memset(set->A, 0, sizeof(ObjectSetBucket) * set->sizeA);
     set->B = NULL;
     return set;
 }
@@ -73,7 +75,8 @@ void _objectSetTestResize(ObjectSet *set)
     
     set->sizeB = _objectSetNextSize(set->sizeA);
     set->entriesB = 0;
-    set->B = calloc(sizeof(ObjectSetBucket), set->sizeB);
+    set->B = kalloc(sizeof(ObjectSetBucket) * set->sizeB, NULL);
+    memset(set->B, 0, sizeof(ObjectSetBucket) * set->sizeB);
 }
 
 // (Forward declaration)
@@ -119,8 +122,6 @@ void _objectSetCopyFromAToB(ObjectSet *set)
     assert(!_objectSetAdd(set, obj, false), "Stringset error");
 }
 
-extern MemoryHeader *firstUsedBlock; /// to remove later
-
 /* Returns true if already in the set */
 bool _objectSetAdd(ObjectSet *set, Object *obj, bool doMove)
 {
@@ -160,16 +161,14 @@ bool _objectSetAdd(ObjectSet *set, Object *obj, bool doMove)
     }
     
     /* Add the entry. "bucket" might be in either table. */
-    assert(firstUsedBlock->previous == NULL, "Sweep failed");
     /* If the bucket has no key, we're at the first element in that bucket.
      * If the bucket does have a key, we need to allocate a new element. */
     if (bucket->key != NULL)
     {
-        bucket->next = malloc(sizeof(ObjectSetBucket));
+        bucket->next = kalloc(sizeof(ObjectSetBucket), NULL);
         bucket = bucket->next;
         bucket->next = NULL;
     }
-    assert(firstUsedBlock->previous == NULL, "Sweep failed");
     bucket->key = obj;
     
     if (set->B != NULL && doMove)
@@ -1,6 +1,7 @@
 #include <Scope.h>
 #include <VarList.h>
 #include <World.h>
+#include <gc.h>
 
 void scopeInstall(void **global_symbols, Size symbols_array_len)
 {
@@ -13,43 +14,42 @@ void scopeInstall(void **global_symbols, Size symbols_array_len)
     methodTable_addClosure(scopeMT, symbol("spawn"),
 		closure_newInternal(closureProto, scope_spawn, 1));
     
-    globalScope = object_new(objectProto);
-    Scope *globalScopeData = malloc(sizeof(Scope));
-    globalScope->data = globalScopeData;
-    globalScopeData->world = world_new(worldProto, NULL, NULL);
+    Object *world = world_new(worldProto, NULL, NULL);
+    globalScope = object_newWithData(objectProto, sizeof(Scope) +
+                                     varListSize(symbols_array_len));
+    Scope *globalScopeData = globalScope->scope;
+    globalScopeData->world = world;
     
-    globalScopeData->variables = varListNewPairs(symbols_array_len,
-                                                 global_symbols,
-                                                 globalScopeData->world);
+    globalScopeData->variables = varListInitPairs(
+        (VarList*)(globalScopeData + 1), symbols_array_len, global_symbols,
+        world);
     
     globalScopeData->containing = NULL;
     globalScopeData->caller = NULL;
+    globalScopeData->closure = NULL;
+    globalScope->kind = scopeObject;
 }
 
-/* Reads from the bytecode a list of symbols. Note: the scope's closure must
- * be set outside of this function. */
+/* Makes a scope with variables for the given symbols, which alternate with
+ * their values. Note: the scope's closure must be set outside of this
+ * function. */
 Object *scope_new(Object *self, Object *process, Object *containing,
                   Object *caller, Object *world, Size argCount, Size varCount,
                   Object **symbols)
 {
-    Process *processData = process->process;
-    
-    Object *scope = object_new(self);
+    Size symbolCount = argCount + varCount;
+    // The scope's variables are laid out right after it
+    Object *scope = object_newWithData(self, sizeof(Scope) +
+                                       varListSize(symbolCount));
     assert(self != NULL, "scope has no parent")
-    Scope *scopeData = malloc(sizeof(Scope));
-    scope->data = scopeData;
+    Scope *scopeData = scope->scope;
     scopeData->world = world;
     scopeData->containing = containing;
     scopeData->caller = caller;
-    /* Now we make a mapping from the index that, in the bytecode, represents
-     * the symbol to the actual symbol object. Because the symbols in the
-     * bytecode have contiguous indices starting from 0, we can allocate an
-     * array. */
-    u8 *bytecode = processData->bytecode;
-    Object **processSymbols = processData->symbols;
-    
-    Size symbolCount = argCount + varCount;
-    scopeData->variables = varListNewPairs(symbolCount, (void**)symbols, world);
+    scopeData->closure = NULL;
+    scopeData->variables = varListInitPairs((VarList*)(scopeData + 1),
+                                            symbolCount, (void**)symbols, world);
+    scope->kind = scopeObject;
     
     return scope;
 }
@@ -57,7 +57,7 @@ Object *scope_new(Object *self, Object *process, Object *containing,
 Object *scope_lookupVar(Object *self, Object *symbol)
 {
 	/// todo: throw errors instead of panicking
-	if (symbol == symbol("this"))
+	if (symbol == staticSymbol("this"))
 		return self;
 	Scope *scope = self->scope;
 	assert(scope != NULL, "lookup error");
@@ -77,7 +77,10 @@ Object *scope_lookupVar(Object *self, Object *symbol)
         StringMap *expectedState = thisWorld->world->expectedParentState;
         void *expectedValue = stringMapGet(expectedState, symbol->symbol);
         if (expectedValue == NULL)
+        {
             stringMapSet(expectedState, symbol->symbol, value);
+            gcWriteBarrier(thisWorld, value);
+        }
         else
             panic("inconsistent world: variable changed in parent");
     }
@@ -94,10 +97,15 @@ void scope_setVar(Object *self, Object *symbol, Object *value)
 		Scope *containing = scope->containing->scope;
         set = varListSet(scope->variables, world, symbol, value);
         if (set)
+        {
+            gcWriteBarrier(self, world);
+            gcWriteBarrier(self, value);
 			break;
+        }
 		if (scope == globalScope->scope)
             panic("setVar Error: variable '%s' not found!", symbol->symbol);
-        scope = scope->containing->scope;
+        self = scope->containing;
+        scope = self->scope;
     }
 }
 
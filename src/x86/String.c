@@ -20,13 +20,15 @@
 #include <String.h>
 #include <cstring.h>
 #include <mm.h>
+#include <gc.h>
 
 Object *string_new(Object *self, String val)
 {
-    Object *new = object_send(self, symbol("new"));
     Size len = strlen(val);
-    StringData *stringData = malloc(sizeof(StringData) + sizeof(char) * len);
-    new->data = stringData;
+    Object *new = object_newWithData(self,
+                                     sizeof(StringData) + sizeof(char) * len);
+    StringData *stringData = new->string;
+    new->kind = stringObject;
     stringData->len = len;
     memcpy(stringData->string, val, len);
     return new;
@@ -45,19 +47,21 @@ Object *string_concat(Object *self, Object *other)
     Size otherlen = otherData->len;
     Size newlen = len + otherData->len;
     
-    StringData *newData = malloc(sizeof(StringData) + sizeof(char) * newlen);
+    Object *newString = object_newWithData(self,
+        sizeof(StringData) + sizeof(char) * newlen);
+    StringData *newData = newString->string;
     newData->len = newlen;
     
     memcpy(newData->string, selfData->string, len);
     memcpy(newData->string + len, otherData->string, otherlen);
     
-    Object *newString = object_send(self, symbol("new"));
-    newString->data = newData;
+    newString->kind = stringObject;
     return newString;
 }
 
 void stringInstall()
 {
+    gcAddRoot(&stringProto);
     stringProto = object_send(objectProto, symbol("new"));
     
     /* Add a method table */
@@ -38,12 +38,13 @@ const Size stringMapInitialSize = 5;
 
 StringMap *stringMapNew()
 {
-    StringMap *map = malloc(sizeof(StringMap));
+    StringMap *map = kalloc(sizeof(StringMap), NULL);
     map->sizeA = stringMapInitialSize;
     map->sizeB = 0;
     map->entriesA = 0;
     map->entriesB = 0;
-    map->A = calloc(sizeof(StringMapBucket), stringMapInitialSize);
+    map->A = kalloc(sizeof(StringMapBucket) * stringMapInitialSize, NULL);
+    memset(map->A, 0, sizeof(StringMapBucket) * stringMapInitialSize);
     map->B = NULL;
     return map;
 }
@@ -70,7 +71,8 @@ void _stringMapTestResize(StringMap *map)
     
     map->sizeB = _stringMapNextSize(map->sizeA);
     map->entriesB = 0;
-    map->B = calloc(sizeof(StringMapBucket), map->sizeB);
+    map->B = kalloc(sizeof(StringMapBucket) * map->sizeB, NULL);
+    memset(map->B, 0, sizeof(StringMapBucket) * map->sizeB);
 }
 
 bool _stringMapSet(StringMap *map, String key, void *value, bool doMove);
@@ -158,7 +160,7 @@ bool _stringMapSet(StringMap *map, String key, void *value, bool doMove)
     
     if (bucket->key != NULL)
     {
-        bucket->next = malloc(sizeof(StringMapBucket));
+        bucket->next = kalloc(sizeof(StringMapBucket), NULL);
         bucket = bucket->next;
         bucket->next = NULL;
     }
@@ -235,6 +237,22 @@ void stringMapDel(StringMap *map)
     free(map);
 }
 
+/* Calls function on the value of every entry, in no particular order */
+void stringMapForEachValue(StringMap *map, void (*function)(void *))
+{
+    Size i;
+    StringMapBucket *bucket;
+    for (i = 0; i < map->sizeA; i++)
+        for (bucket = &map->A[i]; bucket != NULL; bucket = bucket->next)
+            if (bucket->key != NULL)
+                function(bucket->value);
+    if (map->B != NULL)
+        for (i = 0; i < map->sizeB; i++)
+            for (bucket = &map->B[i]; bucket != NULL; bucket = bucket->next)
+                if (bucket->key != NULL)
+                    function(bucket->value);
+}
+
 void stringMapDebug(StringMap *map)
 {
     Size i;
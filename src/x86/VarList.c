@@ -38,7 +38,8 @@ VarList *varListNew(Size capacity, void **symbols)
 	/* Given an array of symbols, create a new varList with those
 	 * symbols undefined */
     Size size = capacity + (capacity >> 1); // hashtable size is 150% capacity
-    VarList *table = calloc(sizeof(VarList) + sizeof(VarBucket) * size, 1);
+    VarList *table = kalloc(sizeof(VarList) + sizeof(VarBucket) * size, NULL);
+    memset(table, 0, sizeof(VarList) + sizeof(VarBucket) * size);
     table->capacity = capacity;
     VarBucket *buckets = table->buckets;
     table->size = size;
@@ -60,12 +61,21 @@ VarList *varListNew(Size capacity, void **symbols)
 }
 
 VarList *varListNewPairs(Size capacity, void **symbols, Object *world)
+{
+    VarList *table = kalloc(varListSize(capacity), NULL);
+    return varListInitPairs(table, capacity, symbols, world);
+}
+
+/* Like varListNewPairs(), but in memory of varListSize(capacity) bytes given
+ * by the caller, such as the rest of a scope's data. */
+VarList *varListInitPairs(VarList *table, Size capacity, void **symbols,
+                          Object *world)
 {
     /* Given an array of altenrating symbols and values, create a new varList
      * with those symbols defined */
     Size size = capacity + (capacity >> 1); // hashtable size is 150% capacity
     
-    VarList *table = calloc(sizeof(VarList) + sizeof(VarBucket) * size, 1);
+    memset(table, 0, varListSize(capacity));
     table->capacity = capacity;
     VarBucket *buckets = table->buckets;
     table->size = size;
@@ -83,7 +93,7 @@ VarList *varListNewPairs(Size capacity, void **symbols, Object *world)
         void *value = symbols[i * 2 + 1];
         if (value != NULL)
         {
-            bucket->items = malloc(sizeof(VarListItem));
+            bucket->items = kalloc(sizeof(VarListItem), NULL);
             bucket->items->value = symbols[i * 2 + 1];
             bucket->items->world = world;
             bucket->items->next = NULL;
@@ -130,7 +140,7 @@ bool varListSet(VarList *table, Object *world, Object *var, Object *value)
     
     if (item == NULL)
     {
-        bucket->items = malloc(sizeof(VarListItem));
+        bucket->items = kalloc(sizeof(VarListItem), NULL);
         item = bucket->items;
     }
     else
@@ -147,7 +157,7 @@ bool varListSet(VarList *table, Object *world, Object *var, Object *value)
             else
                 item = item->next;
         }
-        item->next = malloc(sizeof(VarListItem));
+        item->next = kalloc(sizeof(VarListItem), NULL);
         item = item->next;
     }
 
@@ -244,3 +254,26 @@ void varListCommit(VarList *table, Object *world)
         } while (item != NULL);
     }
 }
+
+/* Frees every item in the table, but neither the table itself, which may be
+ * part of a scope's data, nor any of the objects it refers to */
+void varListDelItems(VarList *table)
+{
+    Size i;
+    for (i = 0; i < table->size; i++)
+    {
+        VarListItem *item = table->buckets[i].items;
+        while (item != NULL)
+        {
+            VarListItem *next = item->next;
+            free(item);
+            item = next;
+        }
+    }
+}
+
+void varListDel(VarList *table)
+{
+    varListDelItems(table);
+    free(table);
+}
@@ -21,6 +21,7 @@
 #include <mm.h>
 #include <VarList.h>
 #include <Scope.h>
+#include <gc.h>
 
 void worldInstall()
 {
@@ -53,13 +54,13 @@ Object *world_new(Object *self, Object *scope, Object **catches)
         parentWorld = NULL;
     }
     
-    Object *world = object_new(self);
-    World *data = malloc(sizeof(World));
-    world->world = data;
+    Object *world = object_newWithData(self, sizeof(World));
+    World *data = world->world;
     data->scope = scope;
     data->parent = parentWorld;
     data->catches = catches;
     data->expectedParentState = stringMapNew();
+    world->kind = worldObject;
     return world;
 }
 
@@ -67,6 +68,7 @@ Object *world_new(Object *self, Object *scope, Object **catches)
 Object *world_do(Object *self, Object *block)
 {
     block->closure->world = self;
+    gcWriteBarrier(block, self);
     return send(block, "eval");
 }
 
@@ -5,7 +5,7 @@
 
 String strdup(String s)
 {
-    String new = malloc(sizeof(char) * strlen(s));
+    String new = malloc(sizeof(char) * (strlen(s) + 1));
     strcpy(new, s);
     return new;
 }
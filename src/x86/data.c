@@ -57,13 +57,16 @@ Size stringHash(String s)
 // StringBuilder Implementation //
 //////////////////////////////////
 
-StringBuilder *stringBuilderAlloc()
+StringBuilder *stringBuilderAlloc(Arena *arena)
 {
+    if (arena != NULL)
+        return arenaAlloc(arena, sizeof(StringBuilder));
     return malloc(sizeof(StringBuilder));
 }
 
-StringBuilder *stringBuilderNew(StringBuilder *sb, String initial)
+StringBuilder *stringBuilderNew(StringBuilder *sb, String initial, Arena *arena)
 {
+    sb->arena = arena;
     if (initial == NULL)
     {
         sb->size = 0;
@@ -74,7 +77,10 @@ StringBuilder *stringBuilderNew(StringBuilder *sb, String initial)
         sb->size = strlen(initial);
         sb->capacity = nextSize(sb->size);
     }
-    sb->s = malloc(sizeof(char) * sb->capacity);
+    if (arena != NULL)
+        sb->s = arenaAlloc(arena, sizeof(char) * sb->capacity);
+    else
+        sb->s = malloc(sizeof(char) * sb->capacity);
     if (initial != NULL)
         memcpy(sb->s, initial, sb->size);
     return sb;
@@ -82,13 +88,15 @@ StringBuilder *stringBuilderNew(StringBuilder *sb, String initial)
 
 StringBuilder *stringBuilderDel(StringBuilder *sb)
 {
-    free(sb->s);
+    if (sb->arena == NULL)
+        free(sb->s);
     return sb;
 }
 
 void stringBuilderFree(StringBuilder *sb)
 {
-    free(sb);
+    if (sb->arena == NULL)
+        free(sb);
 }
 
 void stringBuilderAppendN(StringBuilder *sb, String s, Size len)
@@ -97,9 +105,13 @@ void stringBuilderAppendN(StringBuilder *sb, String s, Size len)
     sb->size += len;
     if (sb->size > sb->capacity)
     {
+        Size oldCapacity = sb->capacity;
         do sb->capacity = nextSize(sb->capacity);
         while (sb->size > sb->capacity);
-        sb->s = realloc(sb->s, sb->capacity);
+        if (sb->arena != NULL)
+            sb->s = arenaRealloc(sb->arena, sb->s, oldCapacity, sb->capacity);
+        else
+            sb->s = realloc(sb->s, sb->capacity);
     }
     memcpy(sb->s + size, s, len);
 }
@@ -119,7 +131,7 @@ String stringBuilderToString(StringBuilder *sb)
 {
     stringBuilderAppendN(sb, "\0", 1);
     String s = sb->s;
-    free(sb);
+    stringBuilderFree(sb);
     return s;
 }
 
@@ -219,12 +231,20 @@ void stackDebug(Stack *stack)
 /* The intern table returns a number (0, 1, 2, 3...) for each unique string
  * given. The same number is always returned for the same string. */
 
-InternTable *internTableNew()
+InternTable *internTableNew(Arena *arena)
 {
-    InternTable *table = malloc(sizeof(InternTable));
+    InternTable *table;
+    if (arena != NULL)
+        table = arenaAlloc(arena, sizeof(InternTable));
+    else
+        table = malloc(sizeof(InternTable));
+    table->arena = arena;
     table->count = 0;
     table->capacity = 16;
-    table->table = malloc(sizeof(String*) * table->capacity);
+    if (arena != NULL)
+        table->table = arenaAlloc(arena, sizeof(String*) * table->capacity);
+    else
+        table->table = malloc(sizeof(String*) * table->capacity);
     return table;
 }
 
@@ -238,17 +258,30 @@ Size internString(InternTable *table, String string)
     }
     if (i >= table->capacity)
     {
+        Size oldCapacity = table->capacity;
         table->capacity = nextSize(table->capacity);
-        table->table = realloc(table->table, table->capacity);
+        if (table->arena != NULL)
+            table->table = arenaRealloc(table->arena, table->table,
+                sizeof(String) * oldCapacity, sizeof(String) * table->capacity);
+        else
+            table->table = realloc(table->table, sizeof(String) * table->capacity);
     }
     assert(i == table->count, "intern error");
-    table->table[i] = strdup(string);
+    if (table->arena != NULL)
+    {
+        table->table[i] = arenaAlloc(table->arena, strlen(string) + 1);
+        strcpy(table->table[i], string);
+    }
+    else
+        table->table[i] = strdup(string);
     table->count++;
     return i;
 }
 
 void internTableDel(InternTable *table)
 {
+    if (table->arena != NULL)
+        return;
     /// free all strings
     free(table->table);
     free(table);
@@ -0,0 +1,542 @@
+/*  Copyright (C) 2014 Xander Vedejas <xvedejas@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  Maintained by:
+ *      Xander Vedejas <xvedejas@gmail.com>
+ */
+
+#include <gc.h>
+#include <mm.h>
+#include <vm.h>
+#include <data.h>
+#include <threading.h>
+#include <MethodTable.h>
+#include <ObjectSet.h>
+#include <StringMap.h>
+#include <VarList.h>
+#include <Array.h>
+#include <Number.h>
+#include <Scope.h>
+#include <World.h>
+
+#ifdef VM_DEBUG
+extern ObjectSet *globalObjectSet;
+#endif
+extern StringMap *globalSymbolTable;
+
+/* Every object, young or old, linked through Object.nextObject */
+Object *youngObjects, *oldObjects;
+Size oldCount, promotedSinceMajor, majorInterval;
+/* The nursery chunk being allocated from is the first in nurseryChunks */
+GCChunk *nurseryChunks, *spareChunks;
+Size nurseryChunkCount, spareChunkCount;
+/* How many nursery chunks there must be before the next try at a minor
+ * collection. While collection is refused this keeps moving up, so that
+ * collectionAllowed() is not asked again on every chunk. */
+Size nurseryCollectAt;
+/* Old objects that may refer to young ones. If this overflows, the next
+ * collection is a major one. */
+Object *remembered[gcMaxRemembered];
+Size rememberedCount;
+bool rememberedOverflowed;
+Object **gcRoots[gcMaxRoots];
+Size gcRootCount;
+/* Objects that are marked but whose children may not be. If this overflows,
+ * the objects that did not fit are found again by looking for marked objects
+ * in the object lists. */
+Object *markStack[gcMarkStackSize];
+Size markStackSize;
+bool markStackOverflowed;
+bool majorCollection;
+
+static GCChunk *chunkNew()
+{
+    GCChunk *chunk;
+    if (spareChunks != NULL)
+    {
+        chunk = spareChunks;
+        spareChunks = chunk->next;
+        spareChunkCount--;
+    }
+    else
+        chunk = _kalloc(gcChunkSize, NULL, __FILE__, __LINE__, gcChunkSize);
+    chunk->magic = gcChunkMagic;
+    chunk->live = 0;
+    chunk->top = chunk->start;
+    chunk->end = (u8*)chunk + gcChunkSize;
+    return chunk;
+}
+
+static void chunkRelease(GCChunk *chunk)
+{
+    if (spareChunkCount < gcSpareChunks)
+    {
+        chunk->next = spareChunks;
+        spareChunks = chunk;
+        spareChunkCount++;
+    }
+    else
+    {
+        chunk->magic = 0;
+        free(chunk);
+    }
+}
+
+static void nurseryGrow()
+{
+    GCChunk *chunk = chunkNew();
+    chunk->next = nurseryChunks;
+    nurseryChunks = chunk;
+    nurseryChunkCount++;
+}
+
+void gcInstall()
+{
+    youngObjects = NULL;
+    oldObjects = NULL;
+    oldCount = 0;
+    promotedSinceMajor = 0;
+    majorInterval = gcMinimumInterval;
+    nurseryChunks = NULL;
+    spareChunks = NULL;
+    nurseryChunkCount = 0;
+    spareChunkCount = 0;
+    nurseryCollectAt = gcNurseryChunks;
+    rememberedCount = 0;
+    rememberedOverflowed = false;
+    gcRootCount = 0;
+    nurseryGrow();
+}
+
+/* root is the address of a global variable that may hold an object */
+void gcAddRoot(Object **root)
+{
+    assert(gcRootCount < gcMaxRoots, "Too many GC roots");
+    gcRoots[gcRootCount++] = root;
+}
+
+static inline Stack *pinStack()
+{
+    Object *process = currentProcess();
+    if (process == NULL || process->kind != processObject)
+        return NULL;
+    return &process->process->pinned;
+}
+
+void gcPin(Object *object)
+{
+    Stack *pinned = pinStack();
+    if (pinned != NULL && object != NULL && !isSmallInteger(object))
+        stackPush(pinned, object);
+}
+
+Size gcPinDepth()
+{
+    Stack *pinned = pinStack();
+    return (pinned == NULL) ? 0 : pinned->size;
+}
+
+void gcUnpinTo(Size depth)
+{
+    Stack *pinned = pinStack();
+    if (pinned != NULL && pinned->size > depth)
+        stackPopMany(pinned, pinned->size - depth);
+}
+
+/* Only the current thread may be running bytecode */
+static bool otherProcessesExist()
+{
+    threadingLock();
+    Thread *thread;
+    bool found = false;
+    for (thread = currentThread->next; thread != currentThread;
+         thread = thread->next)
+    {
+        if (thread->status != zombie && thread->process != NULL)
+            found = true;
+    }
+    threadingUnlock();
+    return found;
+}
+
+static bool collectionAllowed()
+{
+    Object *process = currentProcess();
+    return process != NULL && process->kind == processObject &&
+        !otherProcessesExist();
+}
+
+static void collect(bool major);
+
+/* Called by object_newWithData(), which must initialise every other field.
+ * Small data is placed right after the object, and the rest comes from
+ * kalloc(); the collector frees whichever it was. */
+Object *gcAllocObject(Size dataSize)
+{
+    GCChunk *nursery = nurseryChunks;
+    dataSize = (dataSize + 3) & ~3;
+    Size inlineSize = (dataSize <= gcMaxInlineData) ? dataSize : 0;
+    if (unlikely(nursery->top + sizeof(Object) + inlineSize > nursery->end))
+    {
+        if (nurseryChunkCount >= nurseryCollectAt)
+        {
+            if (collectionAllowed())
+                collect(rememberedOverflowed ||
+                        promotedSinceMajor >= majorInterval);
+            else
+                nurseryCollectAt = nurseryChunkCount + gcNurseryChunks;
+        }
+        nurseryGrow();
+        nursery = nurseryChunks;
+    }
+    Object *object = (Object*)nursery->top;
+    nursery->top += sizeof(Object) + inlineSize;
+    if (dataSize == 0)
+        object->data = NULL;
+    else if (inlineSize)
+        object->data = object + 1;
+    else
+        object->data = kalloc(dataSize, NULL);
+    object->flags = objectYoung | objectAllocated;
+    object->nextObject = youngObjects;
+    youngObjects = object;
+    return object;
+}
+
+/* Called through gcWriteBarrier() */
+void gcRemember(Object *object)
+{
+    if (rememberedCount < gcMaxRemembered)
+    {
+        object->flags |= objectRemembered;
+        remembered[rememberedCount++] = object;
+    }
+    else
+        rememberedOverflowed = true;
+}
+
+/* Whether ptr is an object that has not been freed, without a lookup: it
+ * must be in the used part of a nursery or old chunk, and look like the
+ * start of an object. */
+bool gcIsObject(void *ptr)
+{
+    if (ptr == NULL || ((Size)ptr & 3))
+        return false;
+    GCChunk *chunk = gcChunkOf(ptr);
+    if (chunk->magic != gcChunkMagic || (u8*)ptr < chunk->start ||
+        (u8*)ptr + sizeof(Object) > chunk->top)
+        return false;
+    Object *object = ptr;
+    return (object->flags & objectAllocated) && object->kind <= processObject;
+}
+
+/* Whether a collection is about to free this object; only meaningful while
+ * collecting. */
+bool gcDoomed(Object *object)
+{
+    return !(object->flags & objectMarked) &&
+        (majorCollection || (object->flags & objectYoung));
+}
+
+static void markObject(Object *object)
+{
+    if (object == NULL || isSmallInteger(object) ||
+        (object->flags & objectMarked))
+        return;
+    // In a minor collection old objects are taken to be alive
+    if (!majorCollection && !(object->flags & objectYoung))
+        return;
+    object->flags |= objectMarked;
+    if (markStackSize < gcMarkStackSize)
+        markStack[markStackSize++] = object;
+    else
+        markStackOverflowed = true;
+}
+
+static void markValue(void *value)
+{
+    markObject(value);
+}
+
+static void markStackContents(Stack *stack)
+{
+    Size i;
+    for (i = 0; i < stack->size; i++)
+        markObject(stack->array[i]);
+}
+
+static void markVarList(VarList *variables)
+{
+    Size i;
+    for (i = 0; i < variables->size; i++)
+    {
+        VarBucket *bucket = &variables->buckets[i];
+        markObject(bucket->var);
+        VarListItem *item;
+        for (item = bucket->items; item != NULL; item = item->next)
+        {
+            markObject(item->world);
+            markObject(item->value);
+        }
+    }
+}
+
+/* Marks everything an object refers to */
+static void traceObject(Object *object)
+{
+    markObject(object->parent);
+    markObject(object->methodTable);
+    if (object->data == NULL)
+        return;
+    Size i;
+    switch ((ObjectKind)object->kind)
+    {
+        case methodTableObject:
+        {
+            MethodTable *table = object->table;
+            for (i = 0; i < table->size; i++)
+            {
+                markObject(table->buckets[i][0]);
+                markObject(table->buckets[i][1]);
+            }
+        } break;
+        case closureObject:
+        {
+            Closure *closure = object->closure;
+            if (closure->type != userDefinedClosure)
+                break;
+            markObject(closure->parent);
+            markObject(closure->world);
+        } break;
+        case arrayObject:
+        {
+            ArrayData *array = object->array;
+            for (i = 0; i < array->len; i++)
+                markObject(array->objects[i]);
+        } break;
+        case arrayIterObject:
+            markObject(((ArrayIterData*)object->data)->array);
+            break;
+        case rangeIterObject:
+            markObject(((RangeIterData*)object->data)->range);
+            break;
+        case scopeObject:
+        {
+            Scope *scope = object->scope;
+            markVarList(scope->variables);
+            markObject(scope->world);
+            markObject(scope->containing);
+            markObject(scope->caller);
+            markObject(scope->closure);
+        } break;
+        case worldObject:
+        {
+            World *world = object->world;
+            markObject(world->parent);
+            markObject(world->scope);
+            if (world->catches != NULL)
+                for (i = 0; world->catches[i] != NULL; i++)
+                    markObject(world->catches[i]);
+            stringMapForEachValue(world->expectedParentState, markValue);
+        } break;
+        case processObject:
+        {
+            Process *process = object->process;
+            markObject(process->parent);
+            markStackContents(&process->values);
+            markStackContents(&process->scopes);
+            markStackContents(&process->pinned);
+        } break;
+        default:
+            break;
+    }
+}
+
+static void markRemaining()
+{
+    while (markStackSize)
+        traceObject(markStack[--markStackSize]);
+}
+
+static void rescanMarked(Object *list)
+{
+    Object *object;
+    for (object = list; object != NULL; object = object->nextObject)
+    {
+        if (object->flags & objectMarked)
+        {
+            traceObject(object);
+            markRemaining();
+        }
+    }
+}
+
+/* Frees the data a dead object owns, unless it is inside the object's chunk */
+static void objectFinalize(Object *object)
+{
+    void *data = object->data;
+    ObjectKind kind = object->kind;
+    if (data != NULL)
+    {
+        if (kind == scopeObject)
+            varListDelItems(object->scope->variables);
+        else if (kind == worldObject)
+            stringMapDel(object->world->expectedParentState);
+        else if (kind == closureObject &&
+                 object->closure->type == userDefinedClosure)
+            codeRelease(object->closure->unit);
+        // a symbol's string is not its own, and a process's data was freed
+        // with its thread
+        if (kind != plainObject && kind != symbolObject &&
+            kind != processObject && gcChunkOf(data) != gcChunkOf(object))
+            free(data);
+    }
+    object->flags &= ~objectAllocated;
+    #ifdef VM_DEBUG
+    objectSetRemove(globalObjectSet, object);
+    #endif
+}
+
+/* Unlinks the unmarked objects of list onto dead and clears the marks of the
+ * rest, returning how many are left */
+static Size sweepList(Object **list, Object **dead)
+{
+    Size live = 0;
+    while (*list != NULL)
+    {
+        Object *object = *list;
+        if (object->flags & objectMarked)
+        {
+            object->flags &= ~objectMarked;
+            live++;
+            list = &object->nextObject;
+        }
+        else
+        {
+            *list = object->nextObject;
+            object->nextObject = *dead;
+            *dead = object;
+        }
+    }
+    return live;
+}
+
+static void collect(bool major)
+{
+    Object *process = currentProcess();
+    majorCollection = major;
+    markStackSize = 0;
+    markStackOverflowed = false;
+    Size i;
+    for (i = 0; i < gcRootCount; i++)
+        markObject(*gcRoots[i]);
+    markObject(globalScope);
+    stringMapForEachValue(globalSymbolTable, markValue);
+    Code *code;
+    for (code = loadedCode; code != NULL; code = code->next)
+        for (i = 0; i < code->constantCount; i++)
+            markObject(code->constants[i]);
+    markObject(process);
+    traceObject(process); // even if it is old
+    if (!major)
+        for (i = 0; i < rememberedCount; i++)
+            traceObject(remembered[i]);
+    markRemaining();
+    while (markStackOverflowed)
+    {
+        markStackOverflowed = false;
+        rescanMarked(youngObjects);
+        if (major)
+            rescanMarked(oldObjects);
+    }
+
+    methodCachePurge();
+
+    for (i = 0; i < rememberedCount; i++)
+        remembered[i]->flags &= ~objectRemembered;
+    rememberedCount = 0;
+    rememberedOverflowed = false;
+
+    // Take the dead objects out of the lists before freeing any of them
+    Object *dead = NULL;
+    Object *survivors = youngObjects;
+    sweepList(&survivors, &dead);
+    if (major)
+        oldCount = sweepList(&oldObjects, &dead);
+
+    // Promote the young survivors, and their chunks with them
+    Object *object;
+    while (survivors != NULL)
+    {
+        object = survivors;
+        survivors = object->nextObject;
+        object->flags &= ~objectYoung;
+        gcChunkOf(object)->live++;
+        object->nextObject = oldObjects;
+        oldObjects = object;
+        oldCount++;
+        promotedSinceMajor++;
+    }
+    youngObjects = NULL;
+
+    GCChunk *emptyChunks = NULL;
+    while (dead != NULL)
+    {
+        object = dead;
+        dead = object->nextObject;
+        objectFinalize(object);
+        if (object->flags & objectYoung)
+            continue;
+        GCChunk *chunk = gcChunkOf(object);
+        if (--chunk->live == 0)
+        {
+            chunk->next = emptyChunks;
+            emptyChunks = chunk;
+        }
+    }
+
+    // Nursery chunks with survivors now belong to the old generation
+    while (nurseryChunks != NULL)
+    {
+        GCChunk *chunk = nurseryChunks;
+        nurseryChunks = chunk->next;
+        if (chunk->live == 0)
+            chunkRelease(chunk);
+    }
+    nurseryChunkCount = 0;
+    nurseryCollectAt = gcNurseryChunks;
+    while (emptyChunks != NULL)
+    {
+        GCChunk *chunk = emptyChunks;
+        emptyChunks = chunk->next;
+        chunkRelease(chunk);
+    }
+
+    if (major)
+    {
+        majorInterval = max(oldCount, gcMinimumInterval);
+        promotedSinceMajor = 0;
+    }
+    majorCollection = false;
+}
+
+/* A full collection. The nursery starts over afterwards. */
+void gcCollect()
+{
+    if (!collectionAllowed())
+        return;
+    collect(true);
+    nurseryGrow();
+}
@@ -208,16 +208,9 @@ Size matchComment(String source, Size start)
     return 0;
 }
 
-inline void tokenDel(Token *token)
-{
-    assert(token != NULL, "lexer error");
-    if (token->data != NULL)
-        free(token->data);
-    free(token);
-}
-
-/* Lexes a single token at a time */
-Token *lex(String source, Size lastTokenEnd, Token *lastToken)
+/* Lexes a single token at a time. Tokens and their data are allocated from
+ * the given arena, and live until it is reset or deleted. */
+Token *lex(String source, Size lastTokenEnd, Token *lastToken, Arena *arena)
 {
     //printf("lexing starting at: %s\n", source + lastTokenEnd);
     Size i = lastTokenEnd;
@@ -237,7 +230,7 @@ Token *lex(String source, Size lastTokenEnd, Token *lastToken)
     
     Token *tokenNew(TokenType type, String data, Size start, Size end)
     {
-        Token* token = malloc(sizeof(Token));
+        Token* token = arenaAlloc(arena, sizeof(Token));
         token->type = type;
         token->data = data;
         token->line = line;
@@ -248,6 +241,13 @@ Token *lex(String source, Size lastTokenEnd, Token *lastToken)
         return token;
     }
     
+    String tokenData(String start, Size length)
+    {
+        String data = arenaAlloc(arena, sizeof(char) * (length + 1));
+        strlcpy(data, start, length);
+        return data;
+    }
+    
     while (true)
     {
         switch(source[i])
@@ -256,7 +256,7 @@ Token *lex(String source, Size lastTokenEnd, Token *lastToken)
             {
                 i++;
                 Size length = matchSymbol(source, i);
-                String data = strldup(source + i, length);
+                String data = tokenData(source + i, length);
                 Token *token = tokenNew(symbolToken, data, i, i + length);
                 column += length;
                 i += length;
@@ -303,7 +303,7 @@ Token *lex(String source, Size lastTokenEnd, Token *lastToken)
             {
                 Size length = matchKeyword(source, i);
                 //printf("Keyword length: %i\n", length);
-                String data = strldup(source + i, length);
+                String data = tokenData(source + i, length);
                 Token *token = tokenNew(undefToken, data, i, i + length);
                 i += length;
                 column += length;
@@ -321,7 +321,7 @@ Token *lex(String source, Size lastTokenEnd, Token *lastToken)
             case '0' ... '9':
             {
                 Size length = matchNumber(source, i);
-                String data = strldup(source + i, length);
+                String data = tokenData(source + i, length);
                 TokenType type = undefToken;
                 if (strchr(data, '.'))
                     type = doubleToken;
@@ -335,7 +335,7 @@ Token *lex(String source, Size lastTokenEnd, Token *lastToken)
             case '"':
             {
                 Size length = matchString(source, i);
-                String data = strldup(source + i + 1, length - 2);
+                String data = tokenData(source + i + 1, length - 2);
                 Token *token = tokenNew(stringToken, data, i, i + length);
                 column += length;
                 i += length;
@@ -26,6 +26,8 @@
 #include <types.h>
 #include <parser.h>
 #include <parser_tests.h>
+#include <mm_tests.h>
+#include <vm_tests.h>
 #include <video.h>
 #include <pci.h>
 #include <keyboard.h>
@@ -87,6 +89,14 @@ void outd(u16 port, u32 data)
     asm volatile("outl %1, %0" :: "dN" (port), "a" (data));
 }
 
+/* Cycle counter, for benchmarks */
+umax rdtsc()
+{
+    umax rv;
+    asm volatile("rdtsc" : "=A" (rv));
+    return rv;
+}
+
 /* Lets us print to serial out */
 void debugInstall()
 {   
@@ -388,6 +398,68 @@ ThreadFunc testVM()
     //printf("mem used: %x\n", memUsed());
 }
 
+/* Benchmarks and tests that a run=<name> option on the kernel command line
+ * runs once the kernel is up. Those with a thread function are spawned, since
+ * they need a process of their own. */
+typedef struct
+{
+    String name;
+    void (*call)();
+    ThreadFunc (*thread)();
+    bool requested;
+} BootRun;
+
+static BootRun bootRuns[] =
+{
+    {"mmfree", mm_free_benchmark, NULL, false},
+    {"mmaligned", mm_aligned_benchmark, NULL, false},
+    {"vmdispatch", NULL, vm_dispatch_benchmark, false},
+    {NULL, NULL, NULL, false}
+};
+
+/* Marks the runs the command line asks for. This is done before mmInstall(),
+ * which may hand out the memory the command line is in. */
+static void bootRunParseCmdline(String cmdline)
+{
+    String option = cmdline;
+    while (option != NULL && *option)
+    {
+        if (startswith(option, "run="))
+        {
+            String name = option + strlen("run=");
+            BootRun *run;
+            for (run = bootRuns; run->name != NULL; run++)
+            {
+                Size length = strlen(run->name);
+                if (startswith(name, run->name) &&
+                    (name[length] == ' ' || name[length] == '\0'))
+                    break;
+            }
+            if (run->name != NULL)
+                run->requested = true;
+            else
+                printf("Unknown option %s, ignoring.\n", option);
+        }
+        option = strchr(option, ' ');
+        if (option != NULL)
+            option++;
+    }
+}
+
+static void bootRunAll()
+{
+    BootRun *run;
+    for (run = bootRuns; run->name != NULL; run++)
+    {
+        if (!run->requested)
+            continue;
+        if (run->thread != NULL)
+            spawn(run->name, run->thread);
+        else
+            run->call();
+    }
+}
+
 /* This is the very first C function to be called. Here we initialize the various
  * parts of the system with *Install() functions. */
 void kmain(u32 magic, MultibootStructure *multiboot, void *stackPointer)
@@ -396,6 +468,8 @@ void kmain(u32 magic, MultibootStructure *multiboot, void *stackPointer)
     debugInstall();
     printf("Valix OS Pre-Alpha - Built on " __DATE__ " " __TIME__
         "\nCompiled with gcc " __VERSION__ "...\n");
+    if ((multiboot->flags & bit(2)) && multiboot->cmdline != NULL)
+        bootRunParseCmdline(multiboot->cmdline);
     gdtInstall();
     idtInstall();
     isrsInstall();
@@ -417,10 +491,15 @@ void kmain(u32 magic, MultibootStructure *multiboot, void *stackPointer)
     printf("Welcome to Valix Pre-Alpha 1. Type \"help\" for usage information.\n\n");
     
     //compile_test();
+    bootRunAll();
+    //spawn("GC scope test", gc_scope_test);
     
     spawn("VM interactive shell", testVM);
     sweep();
-    while (true);
+    /* All that is left for the init thread is idle-time housekeeping */
+    getCurrentThread()->name = "Memory maintenance";
+    getCurrentThread()->idle = true;
+    mmMaintain();
     
     //pci();
     
@@ -21,53 +21,260 @@
 #include <cstring.h>
 #include <threading.h>
 
+#ifndef __release__
 const u32 mmMagic = 0x9001DEAD;
-MemoryHeader *firstFreeBlock = NULL;
-MemoryHeader *firstUsedBlock = NULL;
+#endif
+/* The smallest free block: a header, its free list links and the boundary
+ * tag. Used blocks are never smaller, so that they can be freed. */
+const Size mmMinimumFreeBlock = sizeof(MemoryHeader) + 3 * sizeof(Size);
+const u32 slabMagic = 0x51ABCAFE;
+/* The first word of an object while it sits in a magazine */
+const u32 magazineTag = 0x3A6A2173;
+/* Free blocks of at least 2^i and less than 2^(i + 1) bytes are in
+ * freeLists[i] */
+MemoryHeader *freeLists[mmFreeListCount];
+/* First pages of the buddy blocks the heap has taken, linked through
+ * Page.next */
+Page *heapRegions = NULL;
+MMStats mmStatistics;
 bool mmInstalled = false;
+/* Whoever holds mmLockMutex may go on to call threadingLock(), as mmStats()
+ * does, but not the other way round: a thread that cannot be switched away
+ * from would never get a busy mutex. For the same reason, interrupt handlers
+ * never take it. */
 Mutex mmLockMutex;
 
-/* This function finds what memory we have available and allocates it as free blocks */
+/* The Page of every page from firstPage onwards. The page type lets _free()
+ * and friends tell slab objects and large blocks from blocks with a
+ * MemoryHeader without looking at the memory. */
+Page *pages = NULL;
+Size firstPage, pageCount;
+/* Free buddy blocks of 2^i pages are in buddyFreeLists[i] */
+Page *buddyFreeLists[mmBuddyOrderCount];
+/* Set whenever used pages are given back to the buddy allocator, so that
+ * mmMaintain() knows to look for pages to zero again. zeroCursor is the index
+ * into pages it carries on looking from. */
+bool pagesNeedZeroing = true;
+Size zeroCursor = 0;
+umax lastIdleSweep = 0;
+/* The most separate ranges of usable memory mmInstall() will take */
+#define mmMaxRanges 32
+
+/* Slab pages are taken from the buddy allocator a chunk at a time. Pages of
+ * slabs that become empty are kept here for reuse by any class, and
+ * mmMaintain() gives those beyond mmSlabPageReserve back to the buddy
+ * allocator. */
+const Size slabChunkOrder = 4;
+Slab *freeSlabPages = NULL;
+Size freeSlabPageCount = 0;
+
+const Size slabSizeClasses[slabSizeClassCount] =
+    { 8, 12, 16, 24, 32, 48, 64, 96, 128, 192, 256 };
+/* Maps (size + 3) / 4 to the smallest size class that fits */
+u8 slabClassOfSize[slabMaxObjectSize / 4 + 1];
+/* Per-class occupancy, reported by meminfo() */
+Size slabPages[slabSizeClassCount];
+Size slabObjects[slabSizeClassCount];
+SlabCache kernelSlabCache;
+
+MMVerifyLevel mmVerifyLevel = mmDefaultVerifyLevel;
+/* Where sampled verification carries on from in the free lists */
+MemoryHeader *freeVerifyCursor = NULL;
+Size freeVerifyList = 0;
+
+bool mmProfiling = false;
+/* Open addressed on (file, line). Site 0 is where allocations go when the
+ * table is full, and is what unprofiled blocks point to. */
+MMProfileSite mmProfileSites[mmProfileSiteCount];
+static inline void mmVerify();
+static inline void checkBlock(MemoryHeader *block, bool free);
+static inline void addToFreeList(MemoryHeader *block);
+static void buddyFree(Page *page, Size order);
+
+static inline void *blockEnd(MemoryHeader *block)
+{
+    return (void*)((Size)block->start + block->size);
+}
+
+/* The header of the block physically following this one in memory */
+static inline MemoryHeader *nextPhysicalBlock(MemoryHeader *block)
+{
+    return blockEnd(block);
+}
+
+/* Only valid when block->previousFree is set */
+static inline MemoryHeader *previousPhysicalBlock(MemoryHeader *block)
+{
+    return ((MemoryHeader**)block)[-1];
+}
+
+/* The header closing off the end of a heap region; no other block is empty */
+static inline bool isFence(MemoryHeader *block)
+{
+    return block->size == 0;
+}
+
+/* A free block's list links are kept in its memory */
+typedef struct
+{
+    MemoryHeader *previous, *next;
+} FreeLinks;
+
+static inline FreeLinks *freeLinks(MemoryHeader *block)
+{
+    return (FreeLinks*)block->start;
+}
+
+/* While profiling, the last word of each heap block holds its call site */
+static inline Size *blockSite(MemoryHeader *block)
+{
+    return (Size*)blockEnd(block) - 1;
+}
+
+/* A used block with an owning thread is in the thread's list of owned
+ * blocks, linked through the words before the profiling site */
+typedef struct
+{
+    MemoryHeader *previous, *next;
+} OwnerLinks;
+
+static inline OwnerLinks *ownerLinks(MemoryHeader *block)
+{
+    return (OwnerLinks*)((Size)blockEnd(block) -
+        (mmProfiling ? sizeof(Size) : 0)) - 1;
+}
+
+/* The bytes of a heap block its owner may use */
+static inline Size blockUsableSize(MemoryHeader *block)
+{
+    return block->size - (mmProfiling ? sizeof(Size) : 0) -
+        (block->thread != NULL ? sizeof(OwnerLinks) : 0);
+}
+
+/* The links live at the end of the block, so a block must be taken out of
+ * its owner's list before its size changes, and put back afterwards */
+static inline void addToOwnerBlocks(MemoryHeader *block)
+{
+    if (block->thread == NULL)
+        return;
+    OwnerLinks *links = ownerLinks(block);
+    links->previous = NULL;
+    links->next = block->thread->ownedBlocks;
+    if (links->next != NULL)
+        ownerLinks(links->next)->previous = block;
+    block->thread->ownedBlocks = block;
+}
+
+static inline void removeFromOwnerBlocks(MemoryHeader *block)
+{
+    if (block->thread == NULL)
+        return;
+    OwnerLinks *links = ownerLinks(block);
+    if (links->previous == NULL)
+    {
+        assert(block->thread->ownedBlocks == block, "MM Fatal Error");
+        block->thread->ownedBlocks = links->next;
+    }
+    else
+        ownerLinks(links->previous)->next = links->next;
+    if (links->next != NULL)
+        ownerLinks(links->next)->previous = links->previous;
+}
+
+/* Fill in a new block header */
+static inline void setHeader(MemoryHeader *block, Size size, bool free,
+                             bool previousFree, Thread *thread)
+{
+    #ifndef __release__
+    block->startMagic = mmMagic;
+    block->endMagic = mmMagic;
+    #endif
+    block->size = size;
+    block->free = free;
+    block->previousFree = previousFree;
+    block->thread = thread;
+}
+
+/* Index of the free list a block of this size belongs in */
+static inline Size freeListOf(Size size)
+{
+    return 31 - __builtin_clz(size);
+}
+
+/* Write the boundary tag at the end of a free block */
+static inline void setFooter(MemoryHeader *block)
+{
+    ((MemoryHeader**)blockEnd(block))[-1] = block;
+}
+
+/* Looks for an mmverify= option on the kernel command line */
+static void mmParseCmdline(String cmdline)
+{
+    String option = cmdline;
+    while (option != NULL && *option)
+    {
+        if (startswith(option, "mmverify="))
+        {
+            String value = option + strlen("mmverify=");
+            if (startswith(value, "off"))
+                mmVerifyLevel = mmVerifyOff;
+            else if (startswith(value, "sampled"))
+                mmVerifyLevel = mmVerifySampled;
+            else if (startswith(value, "full"))
+                mmVerifyLevel = mmVerifyFull;
+            else
+                printf("Unknown option %s, ignoring.\n", option);
+        }
+        else if (startswith(option, "mmprofile"))
+            mmProfiling = true;
+        option = strchr(option, ' ');
+        if (option != NULL)
+            option++;
+    }
+}
+
+/* This function finds what memory we have available and gives it to the buddy
+ * allocator. The Page array is carved out of the first range big enough. */
 void mmInstall(MultibootStructure *multiboot)
 {
     // Make sure we have mmap* fields
     assert(multiboot->flags & bit(6), "No memory found!");
     
+    memset(mmProfileSites, 0, sizeof(mmProfileSites));
+    mmProfileSites[0].file = "(other)";
+    memset(freeLists, 0, sizeof(freeLists));
+    memset(buddyFreeLists, 0, sizeof(buddyFreeLists));
+    memset(&mmStatistics, 0, sizeof(MMStats));
+    
+    if ((multiboot->flags & bit(2)) && multiboot->cmdline != NULL)
+        mmParseCmdline(multiboot->cmdline);
+    
     // Fix offset of mmap struct
     MMapField *mmap = multiboot->mmapAddr;
 
-    // Keep track of the last free block found
-    MemoryHeader *previousFreeBlock = NULL;
-
     // Find the addresses that the kernel starts at and ends at
     Size kernelStart = (Size)&linkKernelEntry;
     Size kernelEnd = (Size)&linkKernelEnd;
 
-    void addFreeBlock(Size base, Size length)
+    // Whole pages of usable memory, as page numbers
+    Size rangeStart[mmMaxRanges], rangeEnd[mmMaxRanges];
+    Size ranges = 0;
+    Size lowest = u32max, highest = 0;
+
+    void addRange(Size base, Size length)
     {   
         if (unlikely((Size)base < 0x100000)) 
             return;
         
-        if (unlikely(length < sizeof(MemoryHeader) + sizeof(char)))
+        Size start = (base + mmPageSize - 1) >> mmPageShift;
+        Size end = (base + length) >> mmPageShift;
+        if (end <= start || ranges == mmMaxRanges)
             return;
-
-        MemoryHeader *header = (MemoryHeader*)base;
-        header->memoryBlockStart = (void*)base;
-        header->size             = length - sizeof(MemoryHeader);
-        header->startMagic       = mmMagic;
-        header->next             = NULL;
-        header->previous         = NULL;
-        header->free             = true;
-        header->endMagic         = mmMagic;
-        
-
-        // Add the block header to the list
-        if (firstFreeBlock == NULL)
-            firstFreeBlock = header;
-        else
-            previousFreeBlock->next = header;
-
-        previousFreeBlock = header;
+        rangeStart[ranges] = start;
+        rangeEnd[ranges] = end;
+        ranges++;
+        lowest = min(lowest, start);
+        highest = max(highest, end);
     }
 
     while ((u32)(mmap - multiboot->mmapAddr) < multiboot->mmapLength)
@@ -84,280 +291,1292 @@ void mmInstall(MultibootStructure *multiboot)
             else if (mmap->baseAddr >= kernelStart && mmap->baseAddr <= kernelEnd)
             {
                 /* kernel partially covers block at beginning of block */
-                addFreeBlock(kernelEnd, mmap->length + mmap->baseAddr - kernelEnd);
+                addRange(kernelEnd, mmap->length + mmap->baseAddr - kernelEnd);
             }
             else if (mmap_end >= kernelStart && mmap_end <= kernelEnd)
             {
                 /* kernel partially covers block at end of block */
-                addFreeBlock(mmap->baseAddr, kernelStart - mmap->baseAddr);
+                addRange(mmap->baseAddr, kernelStart - mmap->baseAddr);
             }
             else if (kernelStart >= mmap->baseAddr && kernelEnd <= mmap_end)
             {   
                 /* kernel is within the block */
-                addFreeBlock(mmap->baseAddr, kernelStart - mmap->baseAddr);
-                addFreeBlock(kernelEnd, mmap_end - kernelEnd);
+                addRange(mmap->baseAddr, kernelStart - mmap->baseAddr);
+                addRange(kernelEnd, mmap_end - kernelEnd);
             }
             else
             {
                 /* everything is alright */
-                addFreeBlock(mmap->baseAddr, mmap->length);
+                addRange(mmap->baseAddr, mmap->length);
             }
         }
         mmap = (MMapField*)((Size)mmap + mmap->size + sizeof(mmap->size));
     }
-    firstUsedBlock = NULL;
+    assert(ranges > 0, "No memory found!");
+
+    firstPage = lowest;
+    pageCount = highest - lowest;
+    Size pagesNeeded = (pageCount * sizeof(Page) + mmPageSize - 1) >>
+        mmPageShift;
+    Size i;
+    for (i = 0; i < ranges; i++)
+    {
+        if (rangeEnd[i] - rangeStart[i] > pagesNeeded)
+        {
+            pages = (Page*)(rangeStart[i] << mmPageShift);
+            rangeStart[i] += pagesNeeded;
+            break;
+        }
+    }
+    assert(pages != NULL, "No room for the page array!");
+    memset(pages, 0, pageCount * sizeof(Page));
+    
+    /* Free each range as the largest aligned blocks that fit, which buddyFree()
+     * merges where ranges meet */
+    for (i = 0; i < ranges; i++)
+    {
+        Size page;
+        for (page = rangeStart[i]; page < rangeEnd[i]; page++)
+            pages[page - firstPage].type = pageTail;
+        page = rangeStart[i];
+        while (page < rangeEnd[i])
+        {
+            Size order = 0;
+            while (order + 1 < mmBuddyOrderCount &&
+                   page % (2 << order) == 0 &&
+                   page + (2 << order) <= rangeEnd[i])
+                order++;
+            buddyFree(&pages[page - firstPage], order);
+            page += 1 << order;
+        }
+    }
+    
     mmInstalled = true;
     mmLockMutex.multiplicity = 0;
     mmLockMutex.locked = false;
     mmLockMutex.threadsWaiting = NULL;
+
+    // Set up the slab allocator
+    Size sizeClass = 0;
+    for (i = 0; i <= slabMaxObjectSize / 4; i++)
+    {
+        while (slabSizeClasses[sizeClass] < i * 4)
+            sizeClass++;
+        slabClassOfSize[i] = sizeClass;
+    }
+    memset(&kernelSlabCache, 0, sizeof(SlabCache));
+    memset(slabPages, 0, sizeof(slabPages));
+    memset(slabObjects, 0, sizeof(slabObjects));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Buddy Allocator                                                           //
+///////////////////////////////////////////////////////////////////////////////
+
+static inline Size pageAddress(Page *page)
+{
+    return (page - pages + firstPage) << mmPageShift;
+}
+
+/* The Page for the page memory points into, or NULL if there is none */
+static inline Page *pageOf(void *memory)
+{
+    Size page = (Size)memory >> mmPageShift;
+    if (unlikely(pages == NULL || page < firstPage ||
+                 page - firstPage >= pageCount))
+        return NULL;
+    return &pages[page - firstPage];
+}
+
+static void buddyListAdd(Page *page, Size order)
+{
+    page->type = pageFree;
+    page->order = order;
+    page->previous = NULL;
+    page->next = buddyFreeLists[order];
+    if (page->next != NULL)
+        page->next->previous = page;
+    buddyFreeLists[order] = page;
+    mmStatistics.freeBytes += mmPageSize << order;
+    mmStatistics.freeBlocks++;
+    mmStatistics.histogram[order + mmPageShift]++;
+}
+
+static void buddyListRemove(Page *page)
+{
+    assert(page->type == pageFree, "MM Fatal Error");
+    if (page->previous == NULL)
+    {
+        assert(buddyFreeLists[page->order] == page, "MM Fatal Error");
+        buddyFreeLists[page->order] = page->next;
+    }
+    else
+        page->previous->next = page->next;
+    if (page->next != NULL)
+        page->next->previous = page->previous;
+    page->previous = NULL;
+    page->next = NULL;
+    mmStatistics.freeBytes -= mmPageSize << page->order;
+    mmStatistics.freeBlocks--;
+    mmStatistics.histogram[page->order + mmPageShift]--;
+}
+
+/* Takes the free block page, of order found, and cuts it down to 2^order
+ * pages. Returns its first page, typed pageTail for the caller to set. */
+static Page *buddySplit(Page *page, Size found, Size order)
+{
+    buddyListRemove(page);
+    // Give back the upper half until the block is the size we want
+    while (found > order)
+    {
+        found--;
+        buddyListAdd(page + (1 << found), found);
+    }
+    page->type = pageTail;
+    page->order = order;
+    return page;
+}
+
+/* Takes a block of 2^order pages, splitting a larger one if there is no free
+ * block that size. Returns its first page, typed pageTail for the caller to
+ * set, or NULL if no block is big enough. */
+static Page *buddyAlloc(Size order)
+{
+    Size found = order;
+    while (found < mmBuddyOrderCount && buddyFreeLists[found] == NULL)
+        found++;
+    if (found == mmBuddyOrderCount)
+        return NULL;
+    return buddySplit(buddyFreeLists[found], found, order);
+}
+
+/* Like buddyAlloc(), but the block has to end at or before page number
+ * limit. Splitting keeps the lower half, so a larger free block will do as
+ * long as its first 2^order pages are low enough. */
+static Page *buddyAllocBelow(Size order, Size limit)
+{
+    Size found;
+    for (found = order; found < mmBuddyOrderCount; found++)
+    {
+        Page *page;
+        for (page = buddyFreeLists[found]; page != NULL; page = page->next)
+        {
+            if (page - pages + firstPage + ((Size)1 << order) <= limit)
+                return buddySplit(page, found, order);
+        }
+    }
+    return NULL;
+}
+
+/* The first page of the free block holding page number index, or NULL if
+ * that page is not free */
+static Page *buddyFreeBlockHolding(Size index)
+{
+    if (index < firstPage || index - firstPage >= pageCount)
+        return NULL;
+    Size order;
+    for (order = 0; order < mmBuddyOrderCount; order++)
+    {
+        Size start = index & ~(((Size)1 << order) - 1);
+        if (start < firstPage)
+            return NULL;
+        Page *page = &pages[start - firstPage];
+        if (page->type == pageFree && page->order == order)
+            return page;
+    }
+    return NULL;
+}
+
+/* Takes the block of 2^order pages holding the free page number index out of
+ * the free block holding it, giving back the rest of that block. Returns its
+ * first page, typed pageTail for the caller to set. */
+static Page *buddyCarve(Size index, Size order)
+{
+    Page *page = buddyFreeBlockHolding(index);
+    assert(page != NULL && page->order >= order, "MM Fatal Error");
+    Size found = page->order;
+    buddyListRemove(page);
+    // Give back whichever half does not hold the page
+    while (found > order)
+    {
+        found--;
+        Page *upper = page + ((Size)1 << found);
+        if (index >= (Size)(upper - pages) + firstPage)
+        {
+            buddyListAdd(page, found);
+            page = upper;
+        }
+        else
+            buddyListAdd(upper, found);
+    }
+    page->type = pageTail;
+    page->order = order;
+    return page;
+}
+
+/* Takes the free page number index out of the block holding it for good */
+static void buddyReserve(Size index)
+{
+    buddyCarve(index, 0)->type = pageReserved;
 }
 
-/* Memory is kept track of in two linked lists, one for free blocks and the other
- * for used blocks. The following functions allow us to add or remove blocks from
- * the linked lists safely. */
-inline void removeFromFreeList(MemoryHeader *block)
+/* Gives back a block of 2^order pages, merging it with its buddy for as long
+ * as the buddy is free */
+static void buddyFree(Page *page, Size order)
+{
+    Size index = page - pages + firstPage;
+    page->type = pageTail;
+    while (order + 1 < mmBuddyOrderCount)
+    {
+        Size buddyIndex = index ^ (1 << order);
+        if (buddyIndex < firstPage || buddyIndex - firstPage >= pageCount)
+            break;
+        Page *buddy = &pages[buddyIndex - firstPage];
+        if (buddy->type != pageFree || buddy->order != order)
+            break;
+        buddyListRemove(buddy);
+        buddy->type = pageTail;
+        index &= ~(1 << order);
+        order++;
+    }
+    buddyListAdd(&pages[index - firstPage], order);
+}
+
+/* Gives back a block of 2^order pages that has been in use, and so no longer
+ * holds only zeros */
+static void buddyFreeUsed(Page *page, Size order)
+{
+    Size i;
+    for (i = 0; i < (Size)1 << order; i++)
+        page[i].zeroed = false;
+    pagesNeedZeroing = true;
+    buddyFree(page, order);
+}
+
+/* Gives back the count pages from page on, which have not been used, as the
+ * largest buddy blocks that fit */
+static void buddyFreeRange(Page *page, Size count)
+{
+    Size index = page - pages + firstPage;
+    while (count > 0)
+    {
+        Size order = 0;
+        while (order + 1 < mmBuddyOrderCount &&
+               index % ((Size)2 << order) == 0 && ((Size)2 << order) <= count)
+            order++;
+        buddyFree(&pages[index - firstPage], order);
+        index += (Size)1 << order;
+        count -= (Size)1 << order;
+    }
+}
+
+/* Like buddyFreeRange(), for pages that have been in use */
+static void buddyFreeUsedRange(Page *page, Size count)
+{
+    Size i;
+    for (i = 0; i < count; i++)
+        page[i].zeroed = false;
+    pagesNeedZeroing = true;
+    buddyFreeRange(page, count);
+}
+
+/* The smallest order of block that holds size bytes */
+static inline Size buddyOrderOf(Size size)
+{
+    Size order = 0;
+    while ((mmPageSize << order) < size)
+        order++;
+    return order;
+}
+
+/* Large blocks with an owning thread are kept in a list anchored in the
+ * Thread, so that freeThread() need not search for them */
+static inline void addToOwnerPages(Page *page)
+{
+    page->previous = NULL;
+    page->next = NULL;
+    if (page->thread == NULL)
+        return;
+    page->next = page->thread->ownedPages;
+    if (page->next != NULL)
+        page->next->previous = page;
+    page->thread->ownedPages = page;
+}
+
+static inline void removeFromOwnerPages(Page *page)
+{
+    if (page->thread == NULL)
+        return;
+    if (page->previous == NULL)
+    {
+        assert(page->thread->ownedPages == page, "MM Fatal Error");
+        page->thread->ownedPages = page->next;
+    }
+    else
+        page->previous->next = page->next;
+    if (page->next != NULL)
+        page->next->previous = page->previous;
+}
+
+/* The number of whole pages that hold size bytes */
+static inline Size pagesOf(Size size)
+{
+    return (size + mmPageSize - 1) >> mmPageShift;
+}
+
+static inline Size largeBlockSize(Page *page)
+{
+    return (Size)page->length << mmPageShift;
+}
+
+/* Grows or shrinks a large block to length pages in place. Growing takes over
+ * the pages just past the block, so it only works if all of those are free;
+ * it returns false, changing nothing, if they are not. */
+static bool largeBlockResize(Page *page, Size length)
+{
+    if (length > (Size)1 << (mmBuddyOrderCount - 1))
+        return false;
+    Size index = page - pages + firstPage;
+    Size i;
+    for (i = page->length; i < length; i++)
+        if (buddyFreeBlockHolding(index + i) == NULL)
+            return false;
+    for (i = page->length; i < length; i++)
+        buddyCarve(index + i, 0);
+    if (length < page->length)
+        buddyFreeUsedRange(page + length, page->length - length);
+    page->length = length;
+    return true;
+}
+
+/* The first page of the large block memory points to, or NULL if memory is
+ * not the start of a large block */
+static inline Page *largeBlockOf(void *memory)
+{
+    if ((Size)memory % mmPageSize != 0)
+        return NULL;
+    Page *page = pageOf(memory);
+    if (page == NULL || page->type != pageLarge)
+        return NULL;
+    return page;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Allocation Profiler                                                       //
+///////////////////////////////////////////////////////////////////////////////
+
+/* Find or make the table entry for a call site. Must be called with
+ * mmLockMutex held, as must the other profiler functions. */
+static u16 profileSite(char *file, Size line)
+{
+    Size i = (((Size)file >> 2) ^ (line * 2654435761u)) %
+        (mmProfileSiteCount - 1) + 1;
+    Size probes;
+    for (probes = 1; probes < mmProfileSiteCount; probes++)
+    {
+        MMProfileSite *site = &mmProfileSites[i];
+        if (site->file == file && site->line == line)
+            return i;
+        if (site->file == NULL)
+        {
+            site->file = file;
+            site->line = line;
+            return i;
+        }
+        if (++i == mmProfileSiteCount)
+            i = 1;
+    }
+    return 0;
+}
+
+static void profileAlloc(u16 index, Size bytes)
+{
+    MMProfileSite *site = &mmProfileSites[index];
+    site->count++;
+    site->bytes += bytes;
+    site->live += bytes;
+    site->peak = max(site->peak, site->live);
+}
+
+static void profileFree(u16 index, Size bytes)
+{
+    mmProfileSites[index].live -= bytes;
+}
+
+static void profileResize(u16 index, Size oldBytes, Size bytes)
+{
+    MMProfileSite *site = &mmProfileSites[index];
+    site->live = site->live - oldBytes + bytes;
+    site->peak = max(site->peak, site->live);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Slab Allocator                                                            //
+///////////////////////////////////////////////////////////////////////////////
+
+/* Returns the slab that memory points into, or NULL if memory is not in a
+ * slab page. */
+static inline Slab *slabOf(void *memory)
+{
+    Page *page = pageOf(memory);
+    if (page == NULL || page->type != pageSlab)
+        return NULL;
+    return (Slab*)((Size)memory & ~(slabPageSize - 1));
+}
+
+static inline Size slabFirstObject()
+{
+    return (sizeof(Slab) + 7) & ~7;
+}
+
+static inline void *slabObjectAt(Slab *slab, Size index)
+{
+    return (void*)slab + slabFirstObject() +
+        index * slabSizeClasses[slab->sizeClass];
+}
+
+/* Gives the index of the object memory points to, or -1 if memory is not
+ * the start of an object in this slab. */
+static inline s32 slabIndexOf(Slab *slab, void *memory)
+{
+    Size offset = (Size)memory - (Size)slab;
+    Size objectSize = slabSizeClasses[slab->sizeClass];
+    if (offset < slabFirstObject())
+        return -1;
+    offset -= slabFirstObject();
+    if (offset % objectSize != 0 || offset / objectSize >= slab->capacity)
+        return -1;
+    return offset / objectSize;
+}
+
+static inline bool slabIsAllocated(Slab *slab, Size index)
+{
+    return (slab->allocated[index / 32] & bit(index % 32)) != 0;
+}
+
+/* Slab lists are doubly linked, with the head kept in a SlabCache */
+static void slabListRemove(Slab **list, Slab *slab)
+{
+    if (slab->previous == NULL)
+    {
+        assert(*list == slab, "MM Fatal Error");
+        *list = slab->next;
+    }
+    else
+        slab->previous->next = slab->next;
+    if (slab->next != NULL)
+        slab->next->previous = slab->previous;
+    slab->previous = NULL;
+    slab->next = NULL;
+}
+
+static void slabListAdd(Slab **list, Slab *slab)
+{
+    slab->previous = NULL;
+    slab->next = *list;
+    if (*list != NULL)
+        (*list)->previous = slab;
+    *list = slab;
+}
+
+/* Take a chunk of pages from the buddy allocator and hand them to the slab
+ * allocator. */
+static void slabGrow()
+{
+    Page *chunk = buddyAlloc(slabChunkOrder);
+    assert(chunk != NULL, "Out of Memory! Was looking for slab pages");
+    Size i;
+    for (i = 0; i < (Size)1 << slabChunkOrder; i++)
+    {
+        Slab *slab = (Slab*)pageAddress(&chunk[i]);
+        chunk[i].type = pageSlab;
+        slab->magic = slabMagic;
+        slab->next = freeSlabPages;
+        freeSlabPages = slab;
+        freeSlabPageCount++;
+    }
+    mmStatistics.usedBytes += mmPageSize << slabChunkOrder;
+    mmStatistics.usedBlocks += (Size)1 << slabChunkOrder;
+}
+
+static Slab *slabNew(SlabCache *cache, Size sizeClass, Thread *thread)
+{
+    if (freeSlabPages == NULL)
+        slabGrow();
+    Slab *slab = freeSlabPages;
+    freeSlabPages = slab->next;
+    freeSlabPageCount--;
+    slab->magic = slabMagic;
+    slab->sizeClass = sizeClass;
+    slab->capacity = (slabPageSize - slabFirstObject()) /
+        slabSizeClasses[sizeClass];
+    assert(slab->capacity <= slabMaxObjects, "MM Fatal Error");
+    slab->inUse = 0;
+    slab->unused = 0;
+    slab->freeList = NULL;
+    slab->thread = thread;
+    slab->sites = NULL;
+    /* Alignment 8 keeps this off the slabs, which are being worked on */
+    if (unlikely(mmProfiling))
+        slab->sites = _kalloc(slab->capacity * sizeof(u16), NULL, __FILE__,
+            __LINE__, 8);
+    memset(slab->allocated, 0, sizeof(slab->allocated));
+    slabListAdd(&cache->partial[sizeClass], slab);
+    slabPages[sizeClass]++;
+    return slab;
+}
+
+/* Gives an empty slab's page back to the pool of free slab pages */
+static void slabRelease(Slab *slab)
+{
+    slabPages[slab->sizeClass]--;
+    slabObjects[slab->sizeClass] -= slab->inUse;
+    if (slab->sites != NULL)
+    {
+        Size i;
+        for (i = 0; i < slab->unused; i++)
+            if (slabIsAllocated(slab, i))
+                profileFree(slab->sites[i], slabSizeClasses[slab->sizeClass]);
+        free(slab->sites);
+        slab->sites = NULL;
+    }
+    slab->magic = 0;
+    slab->next = freeSlabPages;
+    freeSlabPages = slab;
+    freeSlabPageCount++;
+}
+
+static SlabCache *slabCacheOf(Thread *thread)
+{
+    if (thread == NULL)
+        return &kernelSlabCache;
+    if (thread->slabCache == NULL)
+    {
+        thread->slabCache = kalloc(sizeof(SlabCache), NULL);
+        memset(thread->slabCache, 0, sizeof(SlabCache));
+    }
+    return thread->slabCache;
+}
+
+/* Must be called with mmLockMutex held */
+static void *slabAlloc(Size sizeClass, Thread *thread)
+{
+    SlabCache *cache = slabCacheOf(thread);
+    Slab *slab = cache->partial[sizeClass];
+    if (slab == NULL)
+        slab = slabNew(cache, sizeClass, thread);
+    
+    void *object;
+    Size index;
+    if (slab->freeList != NULL)
+    {
+        object = slab->freeList;
+        slab->freeList = *(void**)object;
+        index = slabIndexOf(slab, object);
+    }
+    else
+    {
+        assert(slab->unused < slab->capacity, "MM Fatal Error");
+        index = slab->unused++;
+        object = slabObjectAt(slab, index);
+    }
+    slab->allocated[index / 32] |= bit(index % 32);
+    slab->inUse++;
+    slabObjects[sizeClass]++;
+    
+    if (slab->inUse == slab->capacity)
+    {
+        slabListRemove(&cache->partial[sizeClass], slab);
+        slabListAdd(&cache->full[sizeClass], slab);
+    }
+    return object;
+}
+
+/* Must be called with mmLockMutex held */
+static void slabFree(Slab *slab, void *memory, char *file, Size line)
+{
+    s32 index = slabIndexOf(slab, memory);
+    if (unlikely(index < 0))
+    {
+        printf("Incorrect freeing of unallocated pointer at %x, ignoring.\n", memory);
+        printf("Called from %s, line %i\n", file, line);
+        return;
+    }
+    if (unlikely(!slabIsAllocated(slab, index)))
+    {
+        printf("Memory at %x already freed, ignoring.\n", memory);
+        printf("Called from %s, line %i\n", file, line);
+        return;
+    }
+    
+    SlabCache *cache = slabCacheOf(slab->thread);
+    Size sizeClass = slab->sizeClass;
+    if (slab->inUse == slab->capacity)
+    {
+        slabListRemove(&cache->full[sizeClass], slab);
+        slabListAdd(&cache->partial[sizeClass], slab);
+    }
+    if (slab->sites != NULL)
+        profileFree(slab->sites[index], slabSizeClasses[sizeClass]);
+    slab->allocated[index / 32] &= ~bit(index % 32);
+    *(void**)memory = slab->freeList;
+    slab->freeList = memory;
+    slab->inUse--;
+    slabObjects[sizeClass]--;
+    
+    /* Keep one slab of each class around so that a single object being
+     * allocated and freed over and over doesn't keep taking new pages. */
+    if (slab->inUse == 0 &&
+        (slab->previous != NULL || slab->next != NULL))
+    {
+        slabListRemove(&cache->partial[sizeClass], slab);
+        slabRelease(slab);
+    }
+}
+
+/* A thread's magazines are only ever used by that thread, and not from
+ * interrupt handlers, which could have interrupted the thread halfway through
+ * using them. */
+static inline bool magazineAllowed(Thread *thread)
+{
+    return thread != NULL && thread == getCurrentThread() && !withinISR &&
+        !mmProfiling;
+}
+
+static inline bool magazineUsable(Thread *thread)
+{
+    return magazineAllowed(thread) && thread->slabCache != NULL;
+}
+
+/* Adds the calls a cache's magazines have served to mmStatistics. Must be
+ * called with mmLockMutex held, by the thread the cache belongs to or once
+ * that thread has died, as the counts are changed without the lock. */
+static inline void slabCacheCount(SlabCache *cache)
+{
+    mmStatistics.allocations += cache->allocations;
+    mmStatistics.frees += cache->frees;
+    cache->allocations = 0;
+    cache->frees = 0;
+}
+
+/* Top up a magazine with a batch of objects from the thread's slabs. Must be
+ * called with mmLockMutex held. */
+static void magazineFill(Thread *thread, Size sizeClass)
+{
+    SlabCache *cache = thread->slabCache;
+    slabCacheCount(cache);
+    while (cache->magazineCount[sizeClass] < slabMagazineBatch)
+    {
+        void *object = slabAlloc(sizeClass, thread);
+        *(u32*)object = magazineTag;
+        cache->magazine[sizeClass][cache->magazineCount[sizeClass]++] = object;
+    }
+}
+
+/* Only objects starting with magazineTag can be in a magazine, so the
+ * magazine is only searched for the rare object whose data starts with it. */
+static inline bool magazineContains(SlabCache *cache, Size sizeClass,
+                                    void *object)
+{
+    if (likely(*(u32*)object != magazineTag))
+        return false;
+    Size i;
+    for (i = 0; i < cache->magazineCount[sizeClass]; i++)
+        if (cache->magazine[sizeClass][i] == object)
+            return true;
+    return false;
+}
+
+/* Give up to count objects from a magazine back to their slabs. Must be
+ * called with mmLockMutex held. */
+static void magazineDrain(SlabCache *cache, Size sizeClass, Size count)
+{
+    slabCacheCount(cache);
+    while (count-- && cache->magazineCount[sizeClass])
+    {
+        void *object = cache->magazine[sizeClass][--cache->magazineCount[sizeClass]];
+        slabFree(slabOf(object), object, __FILE__, __LINE__);
+    }
+}
+
+/* Release every slab in a cache, whether or not it still holds objects. */
+static void slabCacheRelease(SlabCache *cache, Thread *thread)
+{
+    Size i;
+    for (i = 0; i < slabSizeClassCount; i++)
+    {
+        magazineDrain(cache, i, slabMagazineSize);
+        Slab **lists[] = { &cache->partial[i], &cache->full[i] };
+        Size j;
+        for (j = 0; j < 2; j++)
+        {
+            while (*lists[j] != NULL)
+            {
+                Slab *slab = *lists[j];
+                #ifndef __release__
+                if (slab->inUse)
+                    printf("Dying thread '%s' failed to free %i objects of "
+                        "size %i, freeing.\n", thread->name, slab->inUse,
+                        slabSizeClasses[i]);
+                #endif
+                slabListRemove(lists[j], slab);
+                slabRelease(slab);
+            }
+        }
+    }
+}
+
+/* Free memory is kept track of in linked lists, one per size range. The
+ * following functions allow us to add or remove blocks from the linked lists
+ * safely, and keep mmStatistics up to date. A block's size must not change
+ * while it is in a list. */
+static inline void removeFromFreeList(MemoryHeader *block)
 {
     assert(block->free, "MM Fatal Error");
+    FreeLinks *links = freeLinks(block);
+    if (freeVerifyCursor == block)
+        freeVerifyCursor = links->next;
 
-    if (block->previous == NULL)
+    Size list = freeListOf(block->size);
+    if (links->previous == NULL)
     {   
-        if (unlikely(firstFreeBlock != block))
+        if (unlikely(freeLists[list] != block))
             panic("MM Fatal Error");
         
-        firstFreeBlock = block->next;
-        firstFreeBlock->previous = NULL;
+        freeLists[list] = links->next;
     }
     else
     {   
-        if (unlikely(firstFreeBlock == block))
+        if (unlikely(freeLists[list] == block))
             panic("MM Fatal Error");
         
-        block->previous->next = block->next;
-        block->next->previous = block->previous;
+        freeLinks(links->previous)->next = links->next;
     }
-    block->next = NULL;
-    block->previous = NULL;
+    if (links->next != NULL)
+        freeLinks(links->next)->previous = links->previous;
+    mmStatistics.freeBytes -= block->size;
+    mmStatistics.freeBlocks--;
+    mmStatistics.histogram[list]--;
 }
 
-inline void addToFreeList(MemoryHeader *block)
+static inline void addToFreeList(MemoryHeader *block)
 {
     assert(block->free, "MM Fatal Error");
     
-    // make sure both block->previous and next are null before adding
-    assert(block->previous == NULL, "MM Fatal Error");
-    assert(block->next == NULL, "MM Fatal Error");
+    // insert at the beginning
+    Size list = freeListOf(block->size);
+    FreeLinks *links = freeLinks(block);
+    links->previous = NULL;
+    links->next = freeLists[list];
+    if (likely(freeLists[list] != NULL))
+        freeLinks(freeLists[list])->previous = block;
+    freeLists[list] = block;
+    mmStatistics.freeBytes += block->size;
+    mmStatistics.freeBlocks++;
+    mmStatistics.histogram[list]++;
+}
+
+/* See mm.h for the output format */
+void mmProfileDump()
+{
+    mutexAcquireLock(&mmLockMutex);
+    Size i;
+    for (i = 0; i < mmProfileSiteCount; i++)
+    {
+        MMProfileSite *site = &mmProfileSites[i];
+        if (site->count)
+            printf("mmprofile,%s,%i,%i,%i,%i,%i\n", site->file, site->line,
+                site->count, site->bytes, site->live, site->peak);
+    }
+    mutexReleaseLock(&mmLockMutex);
+}
+
+void mmProfileDumpThread(Thread *thread)
+{
+    mutexAcquireLock(&mmLockMutex);
+    Size *live = _kalloc(mmProfileSiteCount * sizeof(Size), NULL, __FILE__,
+        __LINE__, 1);
+    memset(live, 0, mmProfileSiteCount * sizeof(Size));
+    MemoryHeader *block;
+    for (block = thread->ownedBlocks; block != NULL;
+         block = ownerLinks(block)->next)
+        live[*blockSite(block)] += block->size;
+    Page *page;
+    for (page = thread->ownedPages; page != NULL; page = page->next)
+        live[page->profileSite] += largeBlockSize(page);
+    if (thread->slabCache != NULL)
+    {
+        Size i, j, k;
+        for (i = 0; i < slabSizeClassCount; i++)
+        {
+            Slab *lists[] = { thread->slabCache->partial[i],
+                              thread->slabCache->full[i] };
+            for (j = 0; j < 2; j++)
+            {
+                Slab *slab;
+                for (slab = lists[j]; slab != NULL; slab = slab->next)
+                {
+                    if (slab->sites == NULL)
+                        continue;
+                    for (k = 0; k < slab->unused; k++)
+                        if (slabIsAllocated(slab, k))
+                            live[slab->sites[k]] += slabSizeClasses[i];
+                }
+            }
+        }
+    }
+    Size i;
+    for (i = 0; i < mmProfileSiteCount; i++)
+        if (live[i])
+            printf("mmprofile-thread,%s,%s,%i,%i\n", thread->name,
+                mmProfileSites[i].file, mmProfileSites[i].line, live[i]);
+    free(live);
+    mutexReleaseLock(&mmLockMutex);
+}
+
+/* The header of the heap block memory points to, or NULL if memory is not in
+ * the heap or its header has been overwritten */
+static inline MemoryHeader *heapBlockOf(void *memory)
+{
+    Page *page = pageOf(memory);
+    if (page == NULL || page->type != pageHeap ||
+        (Size)memory % sizeof(Size) != 0)
+        return NULL;
+    MemoryHeader *header = (MemoryHeader*)((Size)memory - sizeof(MemoryHeader));
+    #ifndef __release__
+    if (header->startMagic != mmMagic || header->endMagic != mmMagic)
+        return NULL;
+    #endif
+    /* Without guard words, check that the header fits in with the block
+     * after it */
+    if (isFence(header) || header->size % sizeof(Size) != 0)
+        return NULL;
+    page = pageOf(blockEnd(header));
+    if (page == NULL || page->type != pageHeap ||
+        nextPhysicalBlock(header)->previousFree != header->free)
+        return NULL;
+    return header;
+}
+
+/* Split the first shift bytes off a free block that has been taken out of
+ * the free list, and give them back to the free list as a block of their own.
+ * Returns the header of the rest, which starts where the alignment wanted. */
+static MemoryHeader *splitAlignmentGap(MemoryHeader *block, Size shift)
+{
+    if (shift == 0)
+        return block;
+    MemoryHeader *aligned = (MemoryHeader*)((Size)block + shift);
+    setHeader(aligned, block->size - shift, true, true, NULL);
+    block->size = shift - sizeof(MemoryHeader);
+    setFooter(block);
+    addToFreeList(block);
+    return aligned;
+}
+
+/* How far into a free block the header must go for the memory after it to be
+ * aligned. The bytes skipped become a free block, so a gap too small to hold
+ * one is widened by another alignment. */
+static inline Size alignShift(MemoryHeader *block, Size alignment)
+{
+    Size shift = (alignment - (Size)block->start % alignment) % alignment;
+    while (shift != 0 && shift < mmMinimumFreeBlock)
+        shift += alignment;
+    return shift;
+}
+
+/* Takes a buddy block of at least bytes bytes (and preferably at least
+ * 2^mmHeapGrowOrder pages) and makes it a new region of the heap: one free
+ * block, closed off by a used "fence" header of size zero, which is never
+ * freed, so coalescing stops at the region end. Returns false if there is
+ * no block big enough. */
+static bool heapGrow(Size bytes)
+{
+    Size order = max(buddyOrderOf(bytes), mmHeapGrowOrder);
+    Page *page = buddyAlloc(order);
+    while (page == NULL && order > buddyOrderOf(bytes))
+        page = buddyAlloc(--order);
+    if (page == NULL)
+        return false;
+    Size i;
+    for (i = 0; i < (Size)1 << order; i++)
+        page[i].type = pageHeap;
+    page->next = heapRegions;
+    heapRegions = page;
+    
+    MemoryHeader *header = (MemoryHeader*)pageAddress(page);
+    setHeader(header, (mmPageSize << order) - 2 * sizeof(MemoryHeader), true,
+        false, NULL);
+    setFooter(header);
+    setHeader(blockEnd(header), 0, false, true, NULL);
+    addToFreeList(header);
+    return true;
+}
+
+/* First fit, starting from the free list that size belongs in. Every block
+ * in a later list is big enough unless it needs to be shifted for alignment,
+ * so usually only the first list has to be searched. */
+static MemoryHeader *findFreeBlock(Size size, Size alignment, Size *shift)
+{
+    Size list;
+    for (list = freeListOf(size); list < mmFreeListCount; list++)
+    {
+        MemoryHeader *block;
+        for (block = freeLists[list]; block != NULL;
+             block = freeLinks(block)->next)
+        {
+            *shift = alignShift(block, alignment);
+            if (block->size >= *shift + size)
+                return block;
+        }
+    }
+    return NULL;
+}
+
+/* Hands out a block fresh from buddyAlloc() as a large block of size bytes.
+ * Only the pages needed to hold them are kept; the rest of the buddy block is
+ * given back straight away. */
+static void largeBlockInit(Page *page, Size size, Thread *thread, char *file,
+    Size line)
+{
+    page->type = pageLarge;
+    page->length = pagesOf(size);
+    buddyFreeRange(page + page->length,
+        ((Size)1 << page->order) - page->length);
+    page->thread = thread;
+    addToOwnerPages(page);
+    page->profileSite = 0;
+    if (unlikely(mmProfiling))
+    {
+        page->profileSite = profileSite(file, line);
+        profileAlloc(page->profileSite, largeBlockSize(page));
+    }
+    mmStatistics.usedBytes += largeBlockSize(page);
+    mmStatistics.usedBlocks++;
+}
+
+/* Use alignment=1 if alignment is not necessary. */
+void *_kalloc(Size size, Thread *thread, char *file, Size line, Size alignment)
+{
+    // next line useful for debugging mm errors
+    //printf("allocating from %s, line %i\n", file, line);
+    /* Thread may be null */
+    
+    /* A thread allocating a small object for itself can usually take one from
+     * its magazine without locking */
+    if (size <= slabMaxObjectSize && size != 0 && alignment <= 4 &&
+        magazineUsable(thread))
+    {
+        SlabCache *cache = thread->slabCache;
+        Size sizeClass = slabClassOfSize[(size + 3) / 4];
+        if (likely(cache->magazineCount[sizeClass] != 0))
+        {
+            cache->allocations++;
+            void *object =
+                cache->magazine[sizeClass][--cache->magazineCount[sizeClass]];
+            *(u32*)object = 0;
+            return object;
+        }
+    }
+    
+    mutexAcquireLock(&mmLockMutex);
+    
+    assert(mmInstalled, "MM Fatal Error");
+    assert(size != 0,
+        "Cannot allocate 0-length memory block (called from %s line %i)",
+        file, line);
+    
+    assert(alignment > 0 && (alignment & (alignment - 1)) == 0,
+        "cannot into alignment %s %i %i", file, line, alignment);
+    mmStatistics.allocations++;
+    
+    /* Slab objects are only guaranteed to be 4-byte aligned */
+    if (size <= slabMaxObjectSize && alignment <= 4)
+    {
+        Size sizeClass = slabClassOfSize[(size + 3) / 4];
+        void *object = slabAlloc(sizeClass, thread);
+        if (magazineAllowed(thread))
+            magazineFill(thread, sizeClass);
+        if (unlikely(mmProfiling))
+        {
+            Slab *slab = slabOf(object);
+            u16 site = profileSite(file, line);
+            slab->sites[slabIndexOf(slab, object)] = site;
+            profileAlloc(site, slabSizeClasses[sizeClass]);
+        }
+        mutexReleaseLock(&mmLockMutex);
+        return object;
+    }
+    
+    /* Large blocks are whole pages, aligned to their size rounded up to a
+     * power of two pages. If there is no buddy block big enough, the heap may
+     * still have room. */
+    if (size >= mmLargeThreshold)
+    {
+        Page *page = buddyAlloc(buddyOrderOf(max(size, alignment)));
+        if (likely(page != NULL))
+        {
+            largeBlockInit(page, size, thread, file, line);
+            mutexReleaseLock(&mmLockMutex);
+            return (void*)pageAddress(page);
+        }
+    }
+    
+    /* Block sizes are kept a multiple of the word size, so that headers and
+     * boundary tags stay aligned. Only the start of the memory needs to be
+     * aligned, so the size is not rounded up any further. */
+    size = (size + sizeof(Size) - 1) & ~(sizeof(Size) - 1);
+    size = max(size, mmMinimumFreeBlock - sizeof(MemoryHeader));
+    if (unlikely(mmProfiling))
+        size += sizeof(Size);
+    if (thread != NULL)
+        size += sizeof(OwnerLinks);
     
-    // insert at the beginning
-    if (likely(firstFreeBlock != NULL))
+    mmVerify();
+    Size shift = 0;
+    MemoryHeader *currentBlock = findFreeBlock(size, alignment, &shift);
+    /* Enough for the block, the largest alignment gap and the fence */
+    if (currentBlock == NULL && heapGrow(size + alignment + mmMinimumFreeBlock +
+                                         2 * sizeof(MemoryHeader)))
+        currentBlock = findFreeBlock(size, alignment, &shift);
+    assert(currentBlock != NULL,
+        "Out of Memory! Was looking for %i bytes (called from %s line %i)",
+            size, file, line);
+    
+    if (mmVerifyLevel != mmVerifyOff)
+        checkBlock(currentBlock, true);
+    removeFromFreeList(currentBlock);
+    currentBlock = splitAlignmentGap(currentBlock, shift);
+    Size leftover = currentBlock->size - size;
+    if (leftover >= mmMinimumFreeBlock)
     {   
-        block->next = firstFreeBlock;
-        firstFreeBlock->previous = block;
-    }
-    firstFreeBlock = block;
-}
-
-inline void removeFromUsedList(MemoryHeader *block)
-{
-    /* This assert tends to fire if modifying mm structures while
-     * looping through them. Don't do this, it is bad! */
-    assert(!block->free, "MM Fatal Error");
-
-    if (block->previous == NULL)
-    {
-        assert(firstUsedBlock == block, "MM Fatal Error");
-        firstUsedBlock = block->next;
-        firstUsedBlock->previous = NULL;
+        // Split into a block just the right size and one for leftovers
+        MemoryHeader *newBlock = /* For leftover memory */
+            (MemoryHeader*)((Size)currentBlock->start + size);
+        setHeader(newBlock, leftover - sizeof(MemoryHeader), true, false,
+            NULL);
+        setFooter(newBlock);
+        addToFreeList(newBlock);
+        currentBlock->size = size;
     }
     else
     {
-        assert(firstUsedBlock != block, "MM Fatal Error");
-        block->previous->next = block->next;
-        block->next->previous = block->previous;
+        // Block is just large enough to be used, not large enough to split
+        nextPhysicalBlock(currentBlock)->previousFree = false;
     }
-    block->next = NULL;
-    block->previous = NULL;
-}
-
-inline void addToUsedList(MemoryHeader *block)
-{
-    assert(!block->free, "MM Fatal Error");
-    // make sure both block->previous and next are null before adding
-    assert(block->previous == NULL, "MM Fatal Error");
-    assert(block->next == NULL, "MM Fatal Error");
-    // insert at the beginning
-    if (firstUsedBlock != NULL)
-    {   
-        block->next = firstUsedBlock;
-        firstUsedBlock->previous = block;
+    currentBlock->free = false;
+    currentBlock->thread = thread;
+    addToOwnerBlocks(currentBlock);
+    mmStatistics.usedBytes += currentBlock->size;
+    mmStatistics.usedBlocks++;
+    if (unlikely(mmProfiling))
+    {
+        *blockSite(currentBlock) = profileSite(file, line);
+        profileAlloc(*blockSite(currentBlock), currentBlock->size);
     }
-    firstUsedBlock = block;
-}
-
-/* Move the block to the first aligned position after block->memoryBlockStart.
- * Never call this while the block is in the free or used lists. */
-MemoryHeader *alignBlock(MemoryHeader *block, Size alignment)
-{
-    // Find the first aligned address after memoryBlockStart + sizeof(MemoryHeader)
-    Size earliest_possible_start = (Size)block->memoryBlockStart +
-                                   sizeof(MemoryHeader);
-    Size aligned_start_offset = alignment -
-                                (earliest_possible_start % alignment);
-    MemoryHeader *new_block = (void*)earliest_possible_start +
-                              aligned_start_offset - sizeof(MemoryHeader);
-    memmove(new_block, block, sizeof(MemoryHeader));
-    return new_block;
+    mmVerify();
+    mutexReleaseLock(&mmLockMutex);
+    return (void*)currentBlock->start;
 }
 
-/* Use alignment=1 if alignment is not necessary. */
-void *_kalloc(Size size, Thread *thread, char *file, Size line, Size alignment)
+/* Memory for a device to read and write directly: size bytes, physically
+ * contiguous (which every block is, as memory is identity mapped), aligned to
+ * alignment and lying entirely at or below the physical address limit. The
+ * block is a large block belonging to no thread, so it lives until it is
+ * given to free(). It must not be given to realloc(), which could move it
+ * above the limit. Returns NULL if there is no free block low enough. */
+void *_dmaAlloc(Size size, Size alignment, Size limit, char *file, Size line)
 {
-    // next line useful for debugging mm errors
-    //printf("allocating from %s, line %i\n", file, line);
-    /* Thread may be null */
     mutexAcquireLock(&mmLockMutex);
-    
     assert(mmInstalled, "MM Fatal Error");
     assert(size != 0,
         "Cannot allocate 0-length memory block (called from %s line %i)",
         file, line);
-    
-    assert(alignment > 0, "cannot into alignment %s %i %i", file, line, alignment);
-    /* If the amount of memory being allocated isn't an exact multiple of
-     * the requested alignment, we make it an exact multiple. */
-    Size remainder = size % alignment;
-    size += alignment - remainder;
-    assert(size % alignment == 0, "Failed to align size");
-    
-    MemoryHeader *currentBlock = firstFreeBlock;
-    sweep();
-    while (true)
+    assert(alignment > 0 && (alignment & (alignment - 1)) == 0,
+        "cannot into alignment %s %i %i", file, line, alignment);
+    Page *page = buddyAllocBelow(buddyOrderOf(max(size, alignment)),
+        (limit >> mmPageShift) + 1);
+    if (page == NULL)
     {
-        assert(currentBlock != NULL,
-            "Out of Memory! Was looking for %i bytes (called from %s line %i)",
-                size, file, line);
-        
-        // Extra unused space in a block is given by extra_space
-        Size extra_space = alignment - ((Size)&currentBlock->start % alignment);
-        // Usable space in a block is given by usable_size
-        Size usable_size = currentBlock->size - extra_space;
-        // The next aligned address after the start of the block:
-        void *next_aligned_address = currentBlock->start + extra_space;
-        
-        if (unlikely(usable_size >= size &&
-            (usable_size <= size + sizeof(MemoryHeader))))
-        {   
-            // Block is just large enough to be used, not large enough to split
-            removeFromFreeList(currentBlock);
-            currentBlock->free = false;
-            currentBlock = alignBlock(currentBlock, alignment);
-            addToUsedList(currentBlock);
-            sweep();
-            currentBlock->thread = thread;
-            mutexReleaseLock(&mmLockMutex);
-            return (void*)currentBlock->start;
-        }
-        else if (currentBlock->size > size)
-        {   
-            // Split into a block just the right size and one for leftovers
-            removeFromFreeList(currentBlock);
-            MemoryHeader *newBlock = /* For leftover memory */
-                (MemoryHeader*)(currentBlock->start + size);
-            newBlock->size = (Size)currentBlock->size - size - sizeof(MemoryHeader);
-            newBlock->free = true;
-            newBlock->startMagic = mmMagic;
-            newBlock->previous = NULL;
-            newBlock->next = NULL;
-            newBlock->endMagic = mmMagic;
-            newBlock->memoryBlockStart = newBlock;
-            addToFreeList(newBlock);
-
-            assert(newBlock->size + size + sizeof(MemoryHeader) ==
-                currentBlock->size, "Header check fail");
-
-            currentBlock->size = size;
-            currentBlock->free = false;
-            currentBlock = alignBlock(currentBlock, alignment);
-            addToUsedList(currentBlock);
+        mutexReleaseLock(&mmLockMutex);
+        return NULL;
+    }
+    mmStatistics.allocations++;
+    largeBlockInit(page, size, NULL, file, line);
+    mutexReleaseLock(&mmLockMutex);
+    return (void*)pageAddress(page);
+}
 
-            sweep();
-            currentBlock->thread = thread;
+/* Tries to reserve the pages holding the physical memory from address to
+ * address + size, such as a region a device is hardwired to use, so that
+ * nothing else is ever allocated there. Returns false, reserving nothing,
+ * unless every one of those pages is free. */
+bool alloc(Size address, Size size)
+{
+    if (size == 0)
+        return true;
+    Size first = address >> mmPageShift;
+    Size last = (address + size - 1) >> mmPageShift;
+    if (last < first)
+        return false; // wraps around the address space
+    mutexAcquireLock(&mmLockMutex);
+    assert(mmInstalled, "MM Fatal Error");
+    Size index;
+    for (index = first; index <= last; index++)
+    {
+        if (buddyFreeBlockHolding(index) == NULL)
+        {
             mutexReleaseLock(&mmLockMutex);
-            return (void*)currentBlock->start;
+            return false;
         }
-        else // Block not large enough. Next.
-            currentBlock = currentBlock->next;
     }
-    panic("MM Fatal Error");
-    return NULL; // here to make compiler happy
+    for (index = first; index <= last; index++)
+        buddyReserve(index);
+    mutexReleaseLock(&mmLockMutex);
+    return true;
 }
 
-/* Tries to allocate a specific block of memory. Returns true if successful. */
-bool alloc(Size address, Size size)
+/* Trim a used block down to size bytes, giving the rest back as a free block
+ * (merged with the one after it, if that is free) when there is room for one.
+ * size must be a multiple of the word size. */
+static void shrinkBlock(MemoryHeader *block, Size size)
 {
-    /// todo
-    return false;
+    Size leftover = block->size - size;
+    if (leftover < mmMinimumFreeBlock)
+        return;
+    MemoryHeader *next = nextPhysicalBlock(block);
+    MemoryHeader *tail = (MemoryHeader*)((Size)block->start + size);
+    setHeader(tail, leftover - sizeof(MemoryHeader), true, false, NULL);
+    if (next->free)
+    {
+        removeFromFreeList(next);
+        tail->size += sizeof(MemoryHeader) + next->size;
+    }
+    setFooter(tail);
+    nextPhysicalBlock(tail)->previousFree = true;
+    addToFreeList(tail);
+    block->size = size;
 }
 
-void *realloc(void *memory, Size size)
+/* Change the size of a single block of allocated memory. Heap blocks grow in
+ * place when the block physically after them is free and large enough, and
+ * shrink in place; slab objects stay put while they fit their size class;
+ * large blocks grow into the free pages past them and shrink by giving back
+ * their last pages, for as long as they stay large. The memory only moves when it has to, and keeps its owning
+ * thread if it does. */
+void *_realloc(void *memory, Size size, char *file, Size line)
 {
-    // change the size of a single block of allocated memory
     mutexAcquireLock(&mmLockMutex);
-    sweep();
-    MemoryHeader *block = (MemoryHeader*)((Size)memory - sizeof(MemoryHeader));
-    /// Need to rewrite this for the changes that allow memory alignment, which
-    /// mean that the header for a block of memory are not necessarily at the
-    /// start of that block but rather right before the beginning of the region
-    /// of allocated memory
-    //~ MemoryHeader *nextBlock = (MemoryHeader*)((Size)&block->start + block->size);
-    //~ if (nextBlock->startMagic == mmMagic && nextBlock->endMagic == mmMagic &&
-        //~ nextBlock->free)
-    //~ {
-        //~ ///
-        //~ 
-        //~ 
-        //~ if (block->size + 2 * sizeof(MemoryHeader) + nextBlock->size < size)
-        //~ {
-            //~ /* Big enough to split nextBlock */
-            //~ Size room = block->size + nextBlock->size;
-            //~ removeFromFreeList(nextBlock);
-            //~ block->size = size;
-            //~ MemoryHeader *newBlock = /* For leftover memory */
-                //~ (MemoryHeader*)(&block->start + size);
-            //~ newBlock->size = room - size;
-            //~ newBlock->free = true;
-            //~ newBlock->startMagic = mmMagic;
-            //~ newBlock->previous = NULL;
-            //~ newBlock->next = NULL;
-            //~ newBlock->endMagic = mmMagic;
-            //~ newBlock->memoryBlockStart = newBlock;
-            //~ newBlock = alignBlock(newBlock);
-            //~ addToFreeList(newBlock);
-            //~ sweep();
-            //~ mutexReleaseLock(&mmLockMutex);
-            //~ return memory;
-        //~ }
-        //~ else if (block->size + sizeof(MemoryHeader) + nextBlock->size < size)
-        //~ {
-            //~ /* Big enough to use nextBlock, not big enough to split */
-            //~ removeFromFreeList(nextBlock);
-            //~ block->size += sizeof(MemoryHeader) + nextBlock->size;
-            //~ sweep();
-            //~ mutexReleaseLock(&mmLockMutex);
-            //~ return memory;
-        //~ }
-        //~ /* else, not big enough, continue */
-    //~ }
-    void *new_mem = malloc(size);
-    memcpy(new_mem, memory, size);
-    free(memory);
+    mmVerify();
+    Size oldSize;
+    Thread *thread;
+    Slab *slab = slabOf(memory);
+    Page *page = largeBlockOf(memory);
+    if (page != NULL)
+    {
+        oldSize = largeBlockSize(page);
+        thread = page->thread;
+        if (size >= mmLargeThreshold && largeBlockResize(page, pagesOf(size)))
+        {
+            mmStatistics.usedBytes += largeBlockSize(page) - oldSize;
+            if (unlikely(mmProfiling))
+                profileResize(page->profileSite, oldSize,
+                    largeBlockSize(page));
+            mutexReleaseLock(&mmLockMutex);
+            return memory;
+        }
+    }
+    else if (slab != NULL)
+    {
+        oldSize = slabSizeClasses[slab->sizeClass];
+        thread = slab->thread;
+        if (size <= oldSize)
+        {
+            mutexReleaseLock(&mmLockMutex);
+            return memory;
+        }
+    }
+    else
+    {
+        MemoryHeader *block = heapBlockOf(memory);
+        assert(block != NULL && !block->free,
+            "Cannot realloc unallocated pointer at %x", memory);
+        oldSize = blockUsableSize(block);
+        thread = block->thread;
+        Size oldBlockSize = block->size;
+        Size newSize = (size + sizeof(Size) - 1) & ~(sizeof(Size) - 1);
+        newSize = max(newSize, mmMinimumFreeBlock - sizeof(MemoryHeader));
+        Size site = 0;
+        if (unlikely(mmProfiling))
+        {
+            newSize += sizeof(Size);
+            site = *blockSite(block);
+        }
+        if (thread != NULL)
+            newSize += sizeof(OwnerLinks);
+        removeFromOwnerBlocks(block);
+        
+        if (newSize > block->size)
+        {
+            // Absorb the next block if that gives us enough room
+            MemoryHeader *next = nextPhysicalBlock(block);
+            if (next->free &&
+                block->size + sizeof(MemoryHeader) + next->size >= newSize)
+            {
+                removeFromFreeList(next);
+                block->size += sizeof(MemoryHeader) + next->size;
+                nextPhysicalBlock(block)->previousFree = false;
+            }
+        }
+        if (newSize <= block->size)
+        {
+            shrinkBlock(block, newSize);
+            addToOwnerBlocks(block);
+            mmStatistics.usedBytes += block->size - oldBlockSize;
+            if (unlikely(mmProfiling))
+            {
+                *blockSite(block) = site;
+                profileResize(site, oldBlockSize, block->size);
+            }
+            mmVerify();
+            mutexReleaseLock(&mmLockMutex);
+            return memory;
+        }
+        addToOwnerBlocks(block);
+    }
+    void *new_mem = _kalloc(size, thread, file, line, 1);
+    memcpy(new_mem, memory, min(size, oldSize));
+    _free(memory, file, line);
     mutexReleaseLock(&mmLockMutex);
     return new_mem;
 }
 
-void *calloc(Size amount, Size elementSize)
+/* A large block only needs clearing in the pages mmMaintain() has not zeroed
+ * already */
+void *_calloc(Size amount, Size elementSize, char *file, Size line)
 {
-    void *mem = malloc(amount * elementSize);
-    memset(mem, 0, amount * elementSize);
+    Size size = amount * elementSize;
+    if (size >= mmLargeThreshold)
+    {
+        mutexAcquireLock(&mmLockMutex);
+        assert(mmInstalled, "MM Fatal Error");
+        Page *page = buddyAlloc(buddyOrderOf(size));
+        if (likely(page != NULL))
+        {
+            mmStatistics.allocations++;
+            largeBlockInit(page, size, getCurrentThread(), file, line);
+        }
+        mutexReleaseLock(&mmLockMutex);
+        if (likely(page != NULL))
+        {
+            Size i;
+            for (i = 0; i < page->length; i++)
+                if (!page[i].zeroed)
+                    memset((void*)pageAddress(&page[i]), 0, mmPageSize);
+            return (void*)pageAddress(page);
+        }
+    }
+    void *mem = _kalloc(size, getCurrentThread(), file, line, 1);
+    memset(mem, 0, size);
     return mem;
 }
 
@@ -365,16 +1584,46 @@ bool isAllocated(void *memory)
 {
     if (memory == NULL)
         return false;
-    MemoryHeader *header = (MemoryHeader*)(memory - sizeof(MemoryHeader));
-    if (header->startMagic != mmMagic || header->endMagic != mmMagic)
-        return false;
-    if (header->free)
-        return false;
-    return true;
+    Slab *slab = slabOf(memory);
+    if (slab != NULL)
+    {
+        s32 index = slabIndexOf(slab, memory);
+        if (slab->magic != slabMagic || index < 0 ||
+            !slabIsAllocated(slab, index))
+            return false;
+        // Objects in a magazine are still marked allocated in their slab
+        return slab->thread == NULL || slab->thread->slabCache == NULL ||
+            !magazineContains(slab->thread->slabCache, slab->sizeClass, memory);
+    }
+    if (largeBlockOf(memory) != NULL)
+        return true;
+    MemoryHeader *header = heapBlockOf(memory);
+    return header != NULL && !header->free;
 }
 
 void _free(void *memory, char *file, Size line)
 {
+    /* A thread freeing one of its own small objects can usually put it in its
+     * magazine without locking. An object already in the magazine is being
+     * freed twice, and is left for the locked path to report. */
+    Slab *slab = slabOf(memory);
+    if (slab != NULL && magazineUsable(slab->thread))
+    {
+        SlabCache *cache = slab->thread->slabCache;
+        Size sizeClass = slab->sizeClass;
+        s32 index = slabIndexOf(slab, memory);
+        if (likely(index >= 0 && slabIsAllocated(slab, index) &&
+            cache->magazineCount[sizeClass] < slabMagazineSize &&
+            !magazineContains(cache, sizeClass, memory)))
+        {
+            *(u32*)memory = magazineTag;
+            cache->magazine[sizeClass][cache->magazineCount[sizeClass]++] =
+                memory;
+            cache->frees++;
+            return;
+        }
+    }
+    
     mutexAcquireLock(&mmLockMutex);
     if (unlikely(memory == NULL))
     {
@@ -386,11 +1635,46 @@ void _free(void *memory, char *file, Size line)
     if (!mmInstalled)
         panic("MM Fatal Error, MM not installed");
 
-    sweep();
+    if (slab != NULL)
+    {
+        if (magazineUsable(slab->thread))
+        {
+            SlabCache *cache = slab->thread->slabCache;
+            if (magazineContains(cache, slab->sizeClass, memory))
+            {
+                printf("Memory at %x already freed, ignoring.\n", memory);
+                printf("Called from %s, line %i\n", file, line);
+                mutexReleaseLock(&mmLockMutex);
+                return;
+            }
+            if (cache->magazineCount[slab->sizeClass] == slabMagazineSize)
+                magazineDrain(cache, slab->sizeClass, slabMagazineBatch);
+        }
+        mmStatistics.frees++;
+        slabFree(slab, memory, file, line);
+        mutexReleaseLock(&mmLockMutex);
+        return;
+    }
+    
+    Page *page = largeBlockOf(memory);
+    if (page != NULL)
+    {
+        mmStatistics.frees++;
+        mmStatistics.usedBytes -= largeBlockSize(page);
+        mmStatistics.usedBlocks--;
+        removeFromOwnerPages(page);
+        if (unlikely(mmProfiling))
+            profileFree(page->profileSite, largeBlockSize(page));
+        buddyFreeUsedRange(page, page->length);
+        mutexReleaseLock(&mmLockMutex);
+        return;
+    }
+
+    mmVerify();
 
-    MemoryHeader *header = (MemoryHeader*)(memory - sizeof(MemoryHeader));
+    MemoryHeader *header = heapBlockOf(memory);
     
-    if (unlikely(header->startMagic != mmMagic || header->endMagic != mmMagic))
+    if (unlikely(header == NULL))
     {
         /* This is not an end-all thing, just happens when the memory given to
          * be freed is in the stack or something, not handled by the memory
@@ -411,41 +1695,40 @@ void _free(void *memory, char *file, Size line)
         return;
     }
     
-    removeFromUsedList(header);
+    mmStatistics.frees++;
+    mmStatistics.usedBytes -= header->size;
+    mmStatistics.usedBlocks--;
+    if (unlikely(mmProfiling))
+        profileFree(*blockSite(header), header->size);
+    removeFromOwnerBlocks(header);
     header->free = true;
-    addToFreeList(header);
-
-    MemoryHeader *merge(MemoryHeader *a, MemoryHeader *b)
-    {   
-        assert((Size)a + sizeof(MemoryHeader) + a->size == (Size)b, "Merge failed");
-        a->size += b->size + sizeof(MemoryHeader);
-        removeFromFreeList(b);
-        return a;
-    }
-
-    MemoryHeader *blockEnd(MemoryHeader *block)
-    {   
-        return (MemoryHeader*)(&block->start + block->size);
+    header->thread = NULL;
+    
+    // Coalesce with the physical neighbours, found through the boundary tags
+    MemoryHeader *next = nextPhysicalBlock(header);
+    if (mmVerifyLevel != mmVerifyOff)
+        checkBlock(next, next->free);
+    if (next->free)
+    {
+        removeFromFreeList(next);
+        header->size += sizeof(MemoryHeader) + next->size;
     }
-
-    MemoryHeader *block = firstFreeBlock;
-
-    while (block != NULL)
-    {   
-        MemoryHeader *next = block->next;
-        if (blockEnd(header) == block)
-        {   
-            merge(header, block);
-        }
-        else if (blockEnd(block) == header)
-        {
-            merge(block, header);
-            header = block;
-        }
-        block = next;
+    if (header->previousFree)
+    {
+        MemoryHeader *previous = previousPhysicalBlock(header);
+        if (mmVerifyLevel != mmVerifyOff)
+            checkBlock(previous, true);
+        assert(previous->free && nextPhysicalBlock(previous) == header,
+            "Merge failed");
+        removeFromFreeList(previous);
+        previous->size += sizeof(MemoryHeader) + header->size;
+        header = previous;
     }
+    setFooter(header);
+    nextPhysicalBlock(header)->previousFree = true;
+    addToFreeList(header);
 
-    sweep();
+    mmVerify();
     mutexReleaseLock(&mmLockMutex);
 }
 
@@ -455,20 +1738,30 @@ void freeThread(Thread *thread)
     if (likely(thread->pid > 0))
         free(thread->stack);
     /* free all blocks left allocated to thread and print warning that
-     * they have not been properly freed at thread end. */
-    MemoryHeader *currentBlock = firstUsedBlock;
-    while (currentBlock != NULL)
+     * they have not been properly freed at thread end */
+    while (thread->ownedBlocks != NULL)
     {
-        MemoryHeader *next = currentBlock->next;
-        if (currentBlock->thread == thread)
-        {
-            #ifndef __release__
-            printf("Dying thread '%s' failed to free %x, size %x, freeing.\n",
-                thread->name, currentBlock->start, currentBlock->size);
-            #endif
-            free(currentBlock->start);
-        }
-        currentBlock = next;
+        MemoryHeader *block = thread->ownedBlocks;
+        #ifndef __release__
+        printf("Dying thread '%s' failed to free %x, size %x, freeing.\n",
+            thread->name, block->start, block->size);
+        #endif
+        free(block->start);
+    }
+    while (thread->ownedPages != NULL)
+    {
+        void *memory = (void*)pageAddress(thread->ownedPages);
+        #ifndef __release__
+        printf("Dying thread '%s' failed to free %x, size %x, freeing.\n",
+            thread->name, memory, largeBlockSize(thread->ownedPages));
+        #endif
+        free(memory);
+    }
+    if (thread->slabCache != NULL)
+    {
+        slabCacheRelease(thread->slabCache, thread);
+        free(thread->slabCache);
+        thread->slabCache = NULL;
     }
     free(thread);
     mutexReleaseLock(&mmLockMutex);
@@ -476,96 +1769,418 @@ void freeThread(Thread *thread)
 
 void meminfo()
 {
-    MemoryHeader *currentBlock = firstFreeBlock;
+    MMStats stats;
+    mmStats(&stats);
     printf("=========== MemInfo ===========\n");
-    do printf("free block at %x, size %x, magic %x %x\n",
-        currentBlock->start,
-        currentBlock->size, currentBlock->startMagic, currentBlock->endMagic);
-    while ((currentBlock = currentBlock->next) != NULL);
+    printf("used %x bytes in %i blocks, free %x bytes in %i blocks\n",
+        stats.usedBytes, stats.usedBlocks, stats.freeBytes, stats.freeBlocks);
+    printf("largest free block %x, %i allocations, %i frees\n",
+        stats.largestFree, stats.allocations, stats.frees);
+    Size i;
+    for (i = 0; i < mmFreeListCount; i++)
+        if (stats.histogram[i])
+            printf("free blocks of size %x to %x: %i\n", 1 << i,
+                (2 << i) - 1, stats.histogram[i]);
 
-    currentBlock = firstUsedBlock;
-    if (currentBlock == NULL)
-        return;
-    do printf("used block at %x, size %x, magic %x %x\n",
-        currentBlock->start,
-        currentBlock->size, currentBlock->startMagic, currentBlock->endMagic);
-    while ((currentBlock = currentBlock->next) != NULL);
+    mutexAcquireLock(&mmLockMutex);
+    for (i = 0; i < slabSizeClassCount; i++)
+        if (slabPages[i])
+            printf("slab class %i: %i pages, %i objects in use\n",
+                slabSizeClasses[i], slabPages[i], slabObjects[i]);
+    printf("%i free slab pages\n", freeSlabPageCount);
+    mutexReleaseLock(&mmLockMutex);
 }
 
 // Amount of memory used
 Size memUsed()
 {
-    Size amount = 0;
-    MemoryHeader *currentBlock = firstUsedBlock;
-    if (currentBlock == NULL)
-        return 0;
-    do
-    {
-        amount += currentBlock->size;
-    } while ((currentBlock = currentBlock->next) != NULL);
-    return amount;
+    return mmStatistics.usedBytes;
 }
 
 // Amount of memory free
 Size memFree()
 {
-    Size amount = 0;
-    MemoryHeader *currentBlock = firstFreeBlock;
-    if (currentBlock == NULL)
-        return 0;
-    do
+    return mmStatistics.freeBytes;
+}
+
+/* Takes a consistent copy of the allocator statistics. Other threads may be
+ * using their magazines meanwhile, so their counts are only read. */
+void mmStats(MMStats *stats)
+{
+    mutexAcquireLock(&mmLockMutex);
+    Thread *current = getCurrentThread();
+    if (current != NULL && current->slabCache != NULL)
+        slabCacheCount(current->slabCache);
+    memcpy(stats, &mmStatistics, sizeof(MMStats));
+    if (current != NULL)
+    {
+        threadingLock();
+        Thread *thread = current;
+        while ((thread = thread->next) != current)
+        {
+            if (thread->slabCache == NULL)
+                continue;
+            stats->allocations += thread->slabCache->allocations;
+            stats->frees += thread->slabCache->frees;
+        }
+        threadingUnlock();
+    }
+    stats->largestFree = 0;
+    Size list = mmFreeListCount;
+    while (list-- > 0)
+    {
+        MemoryHeader *block;
+        for (block = freeLists[list]; block != NULL;
+             block = freeLinks(block)->next)
+            stats->largestFree = max(stats->largestFree, block->size);
+        if (stats->largestFree)
+            break;
+    }
+    Size order = mmBuddyOrderCount;
+    while (order-- > 0)
+    {
+        if (buddyFreeLists[order] != NULL)
+        {
+            stats->largestFree = max(stats->largestFree, mmPageSize << order);
+            break;
+        }
+    }
+    mutexReleaseLock(&mmLockMutex);
+}
+
+/* Checks a single block header for corruption */
+static inline void checkBlock(MemoryHeader *block, bool free)
+{
+    // if this fails, chances are you used malloc() before the memory manager
+    // was initialized.
+    assert(block >= (MemoryHeader*)0x100000, "Sweep failed");
+    #ifndef __release__
+    assert(block->startMagic == mmMagic, "Sweep failed, possible buffer overflow");
+    assert(block->endMagic == mmMagic, "Sweep failed, possible buffer underflow");
+    #endif
+    assert(block->free == free, "Sweep failed");
+    assert(block->size % sizeof(Size) == 0, "Sweep failed, bad block size");
+    Page *page = pageOf(block);
+    assert(page != NULL && page->type == pageHeap,
+        "Sweep failed, memory header not in the heap");
+    if (isFence(block))
+        return;
+    assert(nextPhysicalBlock(block)->previousFree == free,
+        "Sweep failed, possible buffer overflow");
+    if (free)
     {
-        amount += currentBlock->size;
-    } while ((currentBlock = currentBlock->next) != NULL);
-    return amount;
+        assert(block->size >= mmMinimumFreeBlock - sizeof(MemoryHeader),
+            "Sweep failed");
+        assert(((MemoryHeader**)blockEnd(block))[-1] == block,
+            "Sweep failed, boundary tag overwritten");
+    }
 }
 
+/* Checks every free list and every block of the heap */
 void sweep() // quick tests
 {
     mutexAcquireLock(&mmLockMutex);
-    MemoryHeader *currentBlock = firstFreeBlock;
-    // if assert fails on next line, chances are you used malloc() before
-    // the memory manager was initialized.
-    assert(currentBlock >= (MemoryHeader*)0x100000, "Sweep failed");
-    assert(currentBlock->previous == NULL, "Sweep failed");
-    do
-    {
-        assert(currentBlock->startMagic == mmMagic, "Sweep failed, possible buffer overflow");
-        assert(currentBlock->endMagic == mmMagic, "Sweep failed, possible buffer underflow");
-        assert(currentBlock->free, "Sweep failed");
-        assert((Size)currentBlock->memoryBlockStart <= (Size)currentBlock, "Sweep failed, memory header not within block");
+    MemoryHeader *currentBlock;
+    Size list, freeBlocks = 0;
+    for (list = 0; list < mmFreeListCount; list++)
+    {
+        currentBlock = freeLists[list];
+        if (currentBlock == NULL)
+            continue;
+        assert(freeLinks(currentBlock)->previous == NULL, "Sweep failed");
+        do
+        {
+            checkBlock(currentBlock, true);
+            assert(freeListOf(currentBlock->size) == list, "Sweep failed");
+            freeBlocks++;
+        } while ((currentBlock = freeLinks(currentBlock)->next) != NULL);
+    }
+    Page *page;
+    for (list = 0; list < mmBuddyOrderCount; list++)
+    {
+        for (page = buddyFreeLists[list]; page != NULL; page = page->next)
+        {
+            assert(page->type == pageFree && page->order == list,
+                "Sweep failed, buddy free list corrupted");
+            assert((page - pages + firstPage) % ((Size)1 << list) == 0,
+                "Sweep failed, misaligned buddy block");
+            freeBlocks++;
+        }
+    }
+    assert(freeBlocks == mmStatistics.freeBlocks, "Sweep failed");
+
+    for (page = heapRegions; page != NULL; page = page->next)
+    {
+        currentBlock = (MemoryHeader*)pageAddress(page);
+        assert(!currentBlock->previousFree, "Sweep failed");
+        for (; !isFence(currentBlock);
+             currentBlock = nextPhysicalBlock(currentBlock))
+            checkBlock(currentBlock, currentBlock->free);
+        checkBlock(currentBlock, false);
         assert((Size)currentBlock->start ==
-            (Size)currentBlock + sizeof(MemoryHeader), "Sweep failed");
-    } while ((currentBlock = currentBlock->next) >= (MemoryHeader*)0x100000);
+            pageAddress(page) + (mmPageSize << page->order),
+            "Sweep failed, heap region overrun");
+    }
+    mutexReleaseLock(&mmLockMutex);
+}
 
-    currentBlock = firstUsedBlock;
-    if (currentBlock == NULL)
+/* Checks the next few blocks of the free lists, round-robin */
+static void sweepSample()
+{
+    Size i;
+    for (i = 0; i < mmVerifySampleSize; i++)
     {
-        mutexReleaseLock(&mmLockMutex);
-        return;
+        Size tries = 0;
+        while (freeVerifyCursor == NULL && tries++ < mmFreeListCount)
+        {
+            freeVerifyList = (freeVerifyList + 1) % mmFreeListCount;
+            freeVerifyCursor = freeLists[freeVerifyList];
+        }
+        if (freeVerifyCursor == NULL)
+            break;
+        checkBlock(freeVerifyCursor, true);
+        freeVerifyCursor = freeLinks(freeVerifyCursor)->next;
+    }
+}
+
+/* Called on entry to and exit from the allocator, with mmLockMutex held */
+static inline void mmVerify()
+{
+    switch (mmVerifyLevel)
+    {
+        case mmVerifyOff:
+            return;
+        case mmVerifySampled:
+            sweepSample();
+            return;
+        case mmVerifyFull:
+            sweep();
+            return;
     }
-    assert(currentBlock->previous == NULL, "Sweep failed");
-    do
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Idle-time Maintenance                                                     //
+///////////////////////////////////////////////////////////////////////////////
+
+/* Gives a heap region that has become a single free block back to the buddy
+ * allocator. The last region is kept, so that a heap that keeps emptying and
+ * filling does not keep taking and giving back the same pages. Must be called
+ * with mmLockMutex held. */
+static bool heapReleaseEmptyRegion()
+{
+    if (heapRegions == NULL || heapRegions->next == NULL)
+        return false;
+    Page **link;
+    for (link = &heapRegions; *link != NULL; link = &(*link)->next)
     {
-        assert(currentBlock->startMagic == mmMagic, "Sweep failed, possible buffer overflow");
-        assert(currentBlock->endMagic == mmMagic, "Sweep failed, possible buffer underflow");
-        assert(!currentBlock->free, "Sweep failed");
-        assert((Size)currentBlock->memoryBlockStart <= (Size)currentBlock, "Sweep failed, memory header not within block");
-        assert((Size)currentBlock->start ==
-            (Size)currentBlock + sizeof(MemoryHeader), "Sweep failed");
-    } while ((currentBlock = currentBlock->next) >= (MemoryHeader*)0x100000);
+        Page *region = *link;
+        MemoryHeader *block = (MemoryHeader*)pageAddress(region);
+        if (!block->free || !isFence(nextPhysicalBlock(block)))
+            continue;
+        removeFromFreeList(block);
+        *link = region->next;
+        Size i;
+        for (i = 0; i < (Size)1 << region->order; i++)
+            region[i].type = pageTail;
+        buddyFreeUsed(region, region->order);
+        return true;
+    }
+    return false;
+}
+
+/* Gives free slab pages beyond mmSlabPageReserve back to the buddy allocator.
+ * Must be called with mmLockMutex held. */
+static bool slabReleaseFreePages()
+{
+    if (freeSlabPageCount <= mmSlabPageReserve)
+        return false;
+    while (freeSlabPageCount > mmSlabPageReserve)
+    {
+        Slab *slab = freeSlabPages;
+        freeSlabPages = slab->next;
+        freeSlabPageCount--;
+        mmStatistics.usedBytes -= mmPageSize;
+        mmStatistics.usedBlocks--;
+        buddyFreeUsed(pageOf(slab), 0);
+    }
+    return true;
+}
+
+/* Zeroes the next free block found that has pages not yet zeroed, at most
+ * 2^mmZeroOrder pages of it. The block is taken out of the free lists while
+ * it is zeroed, so mmLockMutex need not be held for the memset. Returns false
+ * once a whole pass over the pages has found nothing to do. */
+static bool zeroFreePages()
+{
+    mutexAcquireLock(&mmLockMutex);
+    if (zeroCursor == 0)
+    {
+        if (!pagesNeedZeroing)
+        {
+            mutexReleaseLock(&mmLockMutex);
+            return false;
+        }
+        pagesNeedZeroing = false;
+    }
+    Page *block = NULL;
+    Size end = min(zeroCursor + mmZeroScanPages, pageCount);
+    while (zeroCursor < end && block == NULL)
+    {
+        Page *holding = NULL;
+        if (!pages[zeroCursor].zeroed)
+            holding = buddyFreeBlockHolding(zeroCursor + firstPage);
+        if (holding == NULL)
+        {
+            zeroCursor++;
+            continue;
+        }
+        block = buddyCarve(zeroCursor + firstPage,
+            min(holding->order, mmZeroOrder));
+        zeroCursor = block - pages + ((Size)1 << block->order);
+    }
+    if (zeroCursor >= pageCount)
+        zeroCursor = 0;
+    mutexReleaseLock(&mmLockMutex);
+    if (block == NULL)
+        return true;
+    
+    Size i;
+    for (i = 0; i < (Size)1 << block->order; i++)
+    {
+        if (block[i].zeroed)
+            continue;
+        memset((void*)pageAddress(&block[i]), 0, mmPageSize);
+        block[i].zeroed = true;
+    }
+    mutexAcquireLock(&mmLockMutex);
+    buddyFree(block, block->order);
     mutexReleaseLock(&mmLockMutex);
+    return true;
+}
+
+/* See mm.h. Each step takes mmLockMutex only briefly, so a thread woken up
+ * while this runs does not wait long for the allocator. */
+void mmMaintain()
+{
+    while (true)
+    {
+        if (reapThreads())
+            continue;
+        mutexAcquireLock(&mmLockMutex);
+        bool released = heapReleaseEmptyRegion() || slabReleaseFreePages();
+        mutexReleaseLock(&mmLockMutex);
+        if (released || zeroFreePages())
+            continue;
+        if (mmVerifyLevel != mmVerifyOff &&
+            timerTicks - lastIdleSweep >= systemClockFreq)
+        {
+            sweep();
+            lastIdleSweep = timerTicks;
+            continue;
+        }
+        // Nothing left to do until the next interrupt
+        __asm__ __volatile__("hlt;");
+    }
 }
 
 Size memBlockSize(void *memory)
 {
-    MemoryHeader *header = (MemoryHeader*)(memory - sizeof(MemoryHeader));
+    Slab *slab = slabOf(memory);
+    if (slab != NULL)
+        return slabSizeClasses[slab->sizeClass];
+    Page *page = largeBlockOf(memory);
+    if (page != NULL)
+        return largeBlockSize(page);
+    MemoryHeader *header = heapBlockOf(memory);
     
-    if (unlikely(header->startMagic != mmMagic || header->endMagic != mmMagic))
+    if (unlikely(header == NULL || header->free))
     {
         // This is not allocated memory, return 0
         return 0;
     }
     
-    return header->size;
+    return blockUsableSize(header);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Arena Allocator                                                           //
+///////////////////////////////////////////////////////////////////////////////
+
+static ArenaChunk *arenaChunkNew(Size size)
+{
+    ArenaChunk *chunk = malloc(sizeof(ArenaChunk) + size);
+    chunk->next = NULL;
+    // Large blocks are rounded up to a power of two pages; use all of it
+    chunk->size = memBlockSize(chunk) - sizeof(ArenaChunk);
+    chunk->used = 0;
+    return chunk;
+}
+
+Arena *arenaNew(Size chunkSize)
+{
+    Arena *arena = malloc(sizeof(Arena));
+    arena->chunkSize = chunkSize;
+    arena->first = arena->current = arenaChunkNew(chunkSize);
+    return arena;
+}
+
+void *arenaAlloc(Arena *arena, Size size)
+{
+    size = (size + sizeof(Size) - 1) & ~(sizeof(Size) - 1);
+    ArenaChunk *chunk = arena->current;
+    while (chunk->used + size > chunk->size)
+    {
+        /* Chunks after the current one are left over from before an
+         * arenaReset(); use them if they are big enough. */
+        if (chunk->next == NULL || chunk->next->size < size)
+        {
+            ArenaChunk *new = arenaChunkNew(max(arena->chunkSize, size));
+            new->next = chunk->next;
+            chunk->next = new;
+        }
+        chunk = chunk->next;
+        chunk->used = 0;
+    }
+    arena->current = chunk;
+    void *memory = chunk->data + chunk->used;
+    chunk->used += size;
+    return memory;
+}
+
+void *arenaRealloc(Arena *arena, void *memory, Size oldSize, Size size)
+{
+    ArenaChunk *chunk = arena->current;
+    oldSize = (oldSize + sizeof(Size) - 1) & ~(sizeof(Size) - 1);
+    if (memory != NULL && (u8*)memory + oldSize == chunk->data + chunk->used)
+    {
+        Size start = (u8*)memory - chunk->data;
+        Size newSize = (size + sizeof(Size) - 1) & ~(sizeof(Size) - 1);
+        if (start + newSize <= chunk->size)
+        {
+            chunk->used = start + newSize;
+            return memory;
+        }
+    }
+    void *new = arenaAlloc(arena, size);
+    if (memory != NULL)
+        memcpy(new, memory, min(oldSize, size));
+    return new;
+}
+
+void arenaReset(Arena *arena)
+{
+    arena->current = arena->first;
+    arena->first->used = 0;
+}
+
+void arenaDel(Arena *arena)
+{
+    ArenaChunk *chunk = arena->first, *next;
+    for (; chunk != NULL; chunk = next)
+    {
+        next = chunk->next;
+        free(chunk);
+    }
+    free(arena);
 }
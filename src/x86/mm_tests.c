@@ -0,0 +1,111 @@
+/*  Copyright (C) 2014 Xander Vedejas <xvedejas@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <main.h>
+#include <mm.h>
+#include <mm_tests.h>
+
+/* Small linear congruential generator, so that runs are repeatable */
+static u32 benchmarkSeed;
+
+static u32 benchmarkRandom()
+{
+    benchmarkSeed = benchmarkSeed * 1103515245 + 12345;
+    return benchmarkSeed >> 8;
+}
+
+#define benchmarkBlocks 1024
+#define benchmarkRounds 8
+
+/* Allocates a heap full of blocks too large for the slab allocator, then frees
+ * them in random order, so that most frees have to coalesce with neighbours
+ * in a fragmented heap. Reports the average cost of a free() in cycles. */
+void mm_free_benchmark()
+{
+    void **blocks = malloc(benchmarkBlocks * sizeof(void*));
+    Size *order = malloc(benchmarkBlocks * sizeof(Size));
+    Size round, i;
+    umax total = 0, worst = 0;
+    benchmarkSeed = 42;
+    for (round = 0; round < benchmarkRounds; round++)
+    {
+        for (i = 0; i < benchmarkBlocks; i++)
+        {
+            blocks[i] = malloc(slabMaxObjectSize + 1 + benchmarkRandom() % 1024);
+            order[i] = i;
+        }
+        // Fisher-Yates shuffle of the order to free in
+        for (i = benchmarkBlocks - 1; i > 0; i--)
+        {
+            Size j = benchmarkRandom() % (i + 1);
+            Size temp = order[i];
+            order[i] = order[j];
+            order[j] = temp;
+        }
+        for (i = 0; i < benchmarkBlocks; i++)
+        {
+            umax start = rdtsc();
+            free(blocks[order[i]]);
+            umax cycles = rdtsc() - start;
+            total += cycles;
+            worst = max(worst, cycles);
+        }
+    }
+    free(order);
+    free(blocks);
+    printf("free: %i frees, average %i cycles, worst %i cycles\n",
+        benchmarkBlocks * benchmarkRounds,
+        (u32)(total / (benchmarkBlocks * benchmarkRounds)), (u32)worst);
+}
+
+#define alignedBenchmarkRequests 256
+
+/* Makes aligned allocations of the sizes and alignments rumpuser_malloc()
+ * tends to ask for, and reports how many bytes each one takes out of the
+ * free memory beyond what was asked for: headers, rounding and any part of
+ * the alignment gap that was not given back. */
+void mm_aligned_benchmark()
+{
+    const Size alignments[] = { 16, 64, 512, 4096 };
+    void **blocks = malloc(alignedBenchmarkRequests * sizeof(void*));
+    Size round, i;
+    umax totalCycles = 0;
+    Size totalWaste = 0, worstWaste = 0;
+    benchmarkSeed = 42;
+    for (round = 0; round < benchmarkRounds; round++)
+    {
+        for (i = 0; i < alignedBenchmarkRequests; i++)
+        {
+            Size alignment = alignments[benchmarkRandom() % 4];
+            Size length = 1 + benchmarkRandom() % 8192;
+            Size before = memFree();
+            umax start = rdtsc();
+            blocks[i] = aalloc(length, alignment);
+            totalCycles += rdtsc() - start;
+            assert((Size)blocks[i] % alignment == 0, "misaligned allocation");
+            Size waste = before - memFree() - length;
+            totalWaste += waste;
+            worstWaste = max(worstWaste, waste);
+        }
+        for (i = 0; i < alignedBenchmarkRequests; i++)
+            free(blocks[i]);
+    }
+    free(blocks);
+    printf("aalloc: %i requests, average %i wasted bytes, worst %i wasted "
+        "bytes, average %i cycles\n",
+        alignedBenchmarkRequests * benchmarkRounds,
+        totalWaste / (alignedBenchmarkRequests * benchmarkRounds), worstWaste,
+        (u32)(totalCycles / (alignedBenchmarkRequests * benchmarkRounds)));
+}
@@ -24,6 +24,9 @@
 #include <vm.h>
 
 const Size maxKeywordCount = 8;
+/* Everything the compiler allocates comes from an arena made of chunks of
+ * this size, except for the finished bytecode. */
+const Size compilerArenaChunkSize = 0x4000;
 
 // For parser asserts
 #define parserRequire(boolean, message, args...) ({ if (unlikely(!(boolean))) \
@@ -96,10 +99,10 @@ typedef struct parseStructure
     struct parseStructure *next;
 } ParseStructure;
 
-ParseStructure *parseStructureNew()
+ParseStructure *parseStructureNew(Arena *arena)
 {
-    ParseStructure *ps = malloc(sizeof(ParseStructure));
-    ps->sb = stringBuilderNew(stringBuilderAlloc(), NULL);
+    ParseStructure *ps = arenaAlloc(arena, sizeof(ParseStructure));
+    ps->sb = stringBuilderNew(stringBuilderAlloc(arena), NULL, arena);
     ps->next = NULL;
     return ps;
 }
@@ -108,7 +111,7 @@ ParseStructure *parseStructureNew()
 ParseStructure *parseStructurePush(ParseStructure *root)
 {
     while (root->next != NULL) root = root->next;
-    return (root->next = parseStructureNew());
+    return (root->next = parseStructureNew(root->sb->arena));
 }
 
 /* Merge the last two stringbuilders in the linked list into one */
@@ -125,7 +128,6 @@ ParseStructure *parseStructureCommit(ParseStructure *root)
     stringBuilderAppendN(previous->sb, stringBuilderToString(node->sb),
         node->sb->size);
     previous->next = node->next;
-    free(node);
     return previous;
 }
 
@@ -138,11 +140,8 @@ StringBuilder *parseStructureCollapse(ParseStructure *root)
         next = node->next;
         stringBuilderAppendN(root->sb, stringBuilderToString(node->sb),
             node->sb->size);
-        free(node);
     }
-    StringBuilder *result = root->sb;
-    free(root);
-    return result;
+    return root->sb;
 }
 
 void parseStructureDebug(ParseStructure *root)
@@ -171,14 +170,16 @@ void parseStructureDebug(ParseStructure *root)
 
 u8 *compile(String source)
 {
-    ParseStructure *root = parseStructureNew();
-    InternTable *symbolTable = internTableNew();
+    Arena *arena = arenaNew(compilerArenaChunkSize);
+    ParseStructure *root = parseStructureNew(arena);
+    InternTable *symbolTable = internTableNew(arena);
+    InternTable *constantTable = internTableNew(arena);
     Token *curToken = NULL;
     jmp_buf exit; // on case of error
     
     /* First we push a new stringBuilder in our parseStructure. This leaves the
-     * root so that we can add a symbol table to the beginning of the bytecode
-     * later on. */
+     * root so that we can add a symbol table and a constant pool to the
+     * beginning of the bytecode later on. */
     ParseStructure *node = parseStructurePush(root);
     
     /* Now there are a bunch of nested function definitions. They can access
@@ -186,21 +187,15 @@ u8 *compile(String source)
      * and encapsulated, in comparison to a strategy using global variables */
     
     /* We only lex as we need to. This lexes the next token and sets
-     * the variable curToken accordingly. This also does not allow going back;
-     * that is, it frees the previous tokens. Use lookahead() if you don't want
-     * to dispose of the current token yet. */
+     * the variable curToken accordingly. This also does not allow going back.
+     * Tokens live in the arena until compilation is over, so their data can
+     * be kept without copying it. */
     inline void nextToken()
     {
-        Token *previous = curToken;
-        if (unlikely(previous == NULL))
-        {
-            curToken = lex(source, 0, curToken);
-        }
+        if (unlikely(curToken == NULL))
+            curToken = lex(source, 0, curToken, arena);
         else
-        {
-            curToken = lex(source, curToken->end, curToken);
-            tokenDel(previous);
-        }
+            curToken = lex(source, curToken->end, curToken, arena);
         /* it's important to do this:
          * use lookahead if you want not to lose previous tokens */
         curToken->previous = NULL;
@@ -212,6 +207,18 @@ u8 *compile(String source)
         return internString(symbolTable, s);
     }
     
+    /* Each block of bytecode also has a pool of its integer and string
+     * literals, so that the VM makes an object for each only once. An entry
+     * is the literal's bytecode followed by its text, so that 1 and "1" are
+     * different constants. */
+    Size internConstant(u8 kind, String s)
+    {
+        String constant = arenaAlloc(arena, strlen(s) + 2);
+        constant[0] = kind;
+        strcpy(constant + 1, s);
+        return internString(constantTable, constant);
+    }
+    
     /* The following function takes an array of keywords and finds the
      * corresponding message keyword's interned value. Does not work for unary
      * or binary messages, just use intern() instead. */
@@ -222,16 +229,14 @@ u8 *compile(String source)
              
         for (i = 0; i < keywordCount; i++)
             length += strlen(keywords[i]) + 1;
-        String messageName = calloc(length + 1, sizeof(char));
+        String messageName = arenaAlloc(arena, (length + 1) * sizeof(char));
+        messageName[0] = '\0';
         for (i = 0; i < keywordCount; i++)
         {
             strcat(messageName, keywords[i]);
             strcat(messageName, ":"); 
         }
-        Size interned = intern(messageName);
-        // don't free, this string belongs to the interntable now
-        //free(messageName);
-        return interned;
+        return intern(messageName);
     }
     
     /* Look ahead by lexing, then backtracking.
@@ -241,7 +246,7 @@ u8 *compile(String source)
     {
         Token *token = curToken;
         Token *lookahead = NULL;
-        while (n--) curToken = lex(source, curToken->end, curToken);
+        while (n--) curToken = lex(source, curToken->end, curToken, arena);
         lookahead = curToken;
         curToken = token;
         return lookahead;
@@ -517,7 +522,7 @@ u8 *compile(String source)
 			{
 				parserRequire(i < maxKeywordCount, "More keywords than "
 					"allowed in one message");
-				keywords[i++] = strdup(curToken->data);
+				keywords[i++] = curToken->data;
 				nextToken();
 				expectToken(colonToken, "':'");
 				nextToken();
@@ -625,7 +630,7 @@ u8 *compile(String source)
                 String keywords[maxKeywordCount];
                 Size keywordc = 0;
                 
-                keywords[keywordc++] = strdup(curToken->data);
+                keywords[keywordc++] = curToken->data;
                 nextToken();
                 if (curToken->type == colonToken) // not unary message
                 {
@@ -640,7 +645,7 @@ u8 *compile(String source)
                         expectToken(keywordToken, "method keyword");
                         parserRequire(keywordc < maxKeywordCount,
                             "Message has too many keywords");
-                        keywords[keywordc++] = strdup(curToken->data);
+                        keywords[keywordc++] = curToken->data;
                         nextToken();
                         expectToken(colonToken, "':'");
                         nextToken();
@@ -748,7 +753,7 @@ u8 *compile(String source)
             case integerToken:
             {
                 outByte(integerBC, node);
-                outStr(curToken->data, node);
+                outVal(internConstant(integerBC, curToken->data), node);
                 nextToken();
             } break;
             case doubleToken:
@@ -760,7 +765,7 @@ u8 *compile(String source)
             case stringToken:
             {
                 outByte(stringBC, node);
-                outStr(curToken->data, node);
+                outVal(internConstant(stringBC, curToken->data), node);
                 nextToken();
             } break;
             case charToken:
@@ -868,26 +873,10 @@ u8 *compile(String source)
         }
     }
     
-    StringBuilder *cleanup(bool all)
-    {
-        /* if "all" is true, then we don't leave any output to return.
-         * This routine deletes all the existing parse structures. */
-        Token *token = curToken;
-        do tokenDel(token); while ((token = token->previous) != NULL);
-        internTableDel(symbolTable);
-        StringBuilder *result = parseStructureCollapse(root);
-        if (all)
-        {
-            stringBuilderFree(stringBuilderDel(result));
-            return NULL;
-        }
-        return result;
-    }
-    
     if (setjmp(exit))
     {
         /* On the case of error, clean up and return NULL */
-        cleanup(true);
+        arenaDel(arena);
         return NULL;
     }
     
@@ -906,7 +895,14 @@ u8 *compile(String source)
     for (i = 0; i < symbolTable->count; i++)
         outStr(symbolTable->table[i], root);
     
-    StringBuilder *result = cleanup(false);
+    /* Build constant pool */
+    
+    outVal(constantTable->count, root);
+    
+    for (i = 0; i < constantTable->count; i++)
+        outStr(constantTable->table[i], root);
+    
+    StringBuilder *result = parseStructureCollapse(root);
     
     /* Print the result */
     Size bytecodeSize = result->size;
@@ -922,6 +918,11 @@ u8 *compile(String source)
             printf("%c\n", byte);
     }
     
-    return (u8*)stringBuilderToString(result);
+    /* Only the finished bytecode outlives the arena */
+    u8 *bytecode = malloc(bytecodeSize + 1);
+    memcpy(bytecode, result->s, bytecodeSize);
+    bytecode[bytecodeSize] = '\0';
+    arenaDel(arena);
+    return bytecode;
 }
 
@@ -19,15 +19,20 @@
 // note that this code would not work because array has not been declared.
 String input1 = "array = (1, 2, 3).";
 // This is the expected output, typed by hand, for the given input.
-u8 *output1 = (u8*)"\x01""array\x00\x00\x00\x81""1\x00\x81""2\x00\x81""3\x00\x86\x03\x8B\x00\x8A";
+u8 *output1 = (u8*)"\x01""array\x00\x03\x81""1\x00\x81""2\x00\x81""3\x00"
+    "\x87\x00\x00\x81\x00\x81\x01\x81\x02\x86\x03\x8B\x00\x8A";
 // 01      number of symbols defined
 // array   name of first symbol
 // 00      end of first symbol
-// 00 00   parseBlockHeader: no arguments defined, no variables defined
-// 81      integer
-// 1 00    value given by string "1"
+// 03      number of constants defined
+// 81 1 00 first constant: the integer "1"
 // 81 2 00 integer 2
 // 81 3 00 integer 3
+// 87      block
+// 00 00   parseBlockHeader: no arguments defined, no variables defined
+// 81 00   integer, constant 0
+// 81 01   integer, constant 1
+// 81 02   integer, constant 2
 // 86      array
 // 03      with three elements
 // 8B 00   assignment to symbol 0
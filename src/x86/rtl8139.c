@@ -2,6 +2,7 @@
 #include <threading.h>
 #include <interrupts.h>
 #include <cstring.h>
+#include <mm.h>
 
 /* This driver is for the RTL network chip, specifically the rtl8139 (it may
  * support other similar cards in the future). */
@@ -162,12 +163,22 @@ void rtlStart(NetworkInterfaceController *nic)
     //outd(base + MAC0 + 4, *(unsigned long *)(tp->hwaddr.addr + 4));
     
     /* For this part, we will send the chip a memory location to use as its
-     * receive buffer start location. One way to do it, would be to define a
-     * buffer variable and send that variables memory location to the RBSTART
-     * register (0x30). */
-    
-    char rx_buffer[8192 + 16 + 1500];
-    outd(base + RxBuf, (u32)rx_buffer); // RBSTART
+     * receive buffer start location, by writing its physical address to the
+     * RBSTART register (0x30). The card writes into it by DMA for as long as
+     * it runs, so it has to be contiguous, below 4 GiB and outlive this
+     * function. The extra 16 bytes are for the packet header, and the extra
+     * 1500 let a packet run past the end of the ring rather than wrap, as
+     * we set RxCfgWrap below. */
+    if (nic->rxBuffer == NULL)
+    {
+        nic->rxBuffer = dmaAlloc(rxBufferLength + 16 + 1500, 4, mmDmaLimit32);
+        if (nic->rxBuffer == NULL)
+        {
+            printf("RTL8139: no memory for the receive buffer\n");
+            return;
+        }
+    }
+    outd(base + RxBuf, (u32)nic->rxBuffer); // RBSTART
 
     /*  We want to put this in loopback mode, which means anything transmitted
      * is immediately received. Also set burst size. */
@@ -33,6 +33,8 @@
 u32 threadCount;
 volatile u32 ticksUntilSwitch = 0;
 const u32 systemClockFreq = 5000;
+/* Threads that have ended, linked through deadNext, for reapThreads() */
+Thread *volatile deadThreads = NULL;
 
 Thread *getCurrentThread()
 {
@@ -53,6 +55,11 @@ void threadingInstall(void *stackPointer)
     kernelThread->next = kernelThread;
     kernelThread->previous = kernelThread;
     kernelThread->waitingNext = NULL;
+    kernelThread->process = NULL;
+    kernelThread->slabCache = NULL;
+    kernelThread->ownedPages = NULL;
+    kernelThread->ownedBlocks = NULL;
+    kernelThread->idle = false;
     currentThread = kernelThread;
     threadCount = 1;
     threadingLockObj = 0;
@@ -91,11 +98,26 @@ void switchThreads()
     assert(currentThread->next != NULL, "Threading error"); /* Shouldn't happen in a circular list */
     
     Thread *destination = currentThread->next; /* Thread we want to switch to */
-    while (destination->status != running && destination->status != ready &&
-        destination != currentThread) destination = destination->next;
+    Thread *idle = NULL; /* First idle priority thread that could run */
+    for (; destination != currentThread; destination = destination->next)
+    {
+        if (destination->status != running && destination->status != ready)
+            continue;
+        if (!destination->idle)
+            break;
+        if (idle == NULL)
+            idle = destination;
+    }
     
-    if (unlikely(destination == currentThread)) /* No thread to switch to. Return. */
-        return;
+    if (unlikely(destination == currentThread))
+    {
+        /* Only idle priority threads can run, so keep the current thread
+         * unless it is one of them or has stopped running */
+        if (idle == NULL ||
+            (currentThread->status == running && !currentThread->idle))
+            return;
+        destination = idle;
+    }
     
     /// todo: note the available stack size remaining for the thread.
     /// If the amount is unusually low, show a warning. If the stack
@@ -167,14 +189,15 @@ void schedule()
                 {
                     printf("\n\nNo threads left! Idling.\n");
                     ThreadFunc idle() { while (true) asm("hlt"); };
-                    spawn("Idle thread", idle);
+                    spawn("Idle thread", idle)->idle = true;
                     ticksUntilSwitch = 0;
                 }
                 assert(ticksUntilSwitch == 0, "Threading error");
             }
             thread->next->previous = thread->previous;
             thread->previous->next = thread->next;
-            freeThread(thread);
+            thread->deadNext = deadThreads;
+            deadThreads = thread;
         }
     } while ((thread = thread->next) != currentThread);
     /* Now we will see if we want to switch threads */
@@ -186,10 +209,34 @@ void schedule()
     ticksUntilSwitch--;
 }
 
+/* Frees the threads schedule() has taken out of the thread list, returning
+ * whether there were any. freeThread() takes mmLockMutex, which the timer
+ * interrupt must not wait on, so this is left to the memory maintenance
+ * thread. */
+bool reapThreads()
+{
+    if (deadThreads == NULL)
+        return false;
+    /* schedule() may add to the list at any time; exchanging it for an empty
+     * one is a single instruction */
+    Thread *thread = __sync_lock_test_and_set(&deadThreads, NULL);
+    while (thread != NULL)
+    {
+        Thread *next = thread->deadNext;
+        freeThread(thread);
+        thread = next;
+    }
+    return true;
+}
+
 Thread *spawn(String name, ThreadFunc (*func)())
 {
     threadingLock();
     Thread *thread = (Thread*)kalloc(sizeof(Thread), NULL);
+    thread->slabCache = NULL;
+    thread->ownedPages = NULL;
+    thread->ownedBlocks = NULL;
+    thread->idle = false;
     thread->stack = kalloc(systemStackSize, thread);
     thread->pid = pidCount++;
     thread->name = name;
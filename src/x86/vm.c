@@ -34,8 +34,9 @@
 #include <parser.h>
 #include <threading.h>
 #include <types.h>
+#include <gc.h>
 
-// call as readValue(process->bytecode, &process->IP);
+// call as readValue(bytecode, &IP);
 // This function reads in a value from bytecode which may be encoded in
 // 1, 2, or 4 bytes depending on format.
 Size readValue(u8 *bytecode, Size *IP)
@@ -69,7 +70,7 @@ Size readValue(u8 *bytecode, Size *IP)
 	return result;
 }
 
-// call as readString(process->bytecode, &process->IP)
+// call as readString(bytecode, &IP)
 // This function reads a null-terminated byte string from bytecode. It does not
 // create a copy, it only provides a pointer to the string in bytecode.
 String readString(u8 *bytecode, Size *IP)
@@ -79,7 +80,10 @@ String readString(u8 *bytecode, Size *IP)
     return s;
 }
 
+#ifdef VM_DEBUG
+/* Every object, to check gcIsObject() against */
 ObjectSet *globalObjectSet;
+#endif
 
 StringMap *globalSymbolTable;
 
@@ -88,19 +92,29 @@ extern Object *callInternal(void *function, Size argc, va_list args);
 Object *object_bind(Object *self, Object *symbol);
 Object *methodTable_get(Object *self, Object *symbol);
 
-/* Always use this method when creating new objects. */
+/* Always use this method, or object_new(), when creating new objects. The
+ * object's data is dataSize bytes laid out right after it, if it is small;
+ * the caller must initialise it and set the object's kind. */
 /// Todo: separate constructor and allocator
-Object *object_new(Object *self)
+Object *object_newWithData(Object *self, Size dataSize)
 {
-    Object *new = malloc(sizeof(Object));
+    Object *new = gcAllocObject(dataSize);
     new->parent = self;
     // By default, we point to the parent's method table
     new->methodTable = (self == NULL)?NULL:self->methodTable;
-    new->data = NULL;
+    new->kind = plainObject;
+    #ifdef VM_DEBUG
     objectSetAdd(globalObjectSet, new);
+    #endif
+    gcPin(new);
     return new;
 }
 
+Object *object_new(Object *self)
+{
+    return object_newWithData(self, 0);
+}
+
 Object *object_toString(Object *self)
 {
     printf("self %x parent %x gparent %x\n", self, self->parent, self->parent->parent);
@@ -129,26 +143,41 @@ Object *symbol_toString(Object *self)
 	return string_new(stringProto, strdup(self->symbol));
 }
 
-/* There is a global set that tells us if a pointer points to an object in the
- * VM. This is mostly a debugging tool which prevents us from treating arbitrary
- * pointers as if they were objects. */
+/* Tells us if a pointer points to an object in the VM. This is mostly a
+ * debugging tool which prevents us from treating arbitrary pointers as if they
+ * were objects. Building with VM_DEBUG also keeps a global set of every
+ * object, to check the answer against. */
 inline bool isObject(void *ptr)
 {
-    return objectSetHas(globalObjectSet, ptr);
+    bool result = gcIsObject(ptr);
+    #ifdef VM_DEBUG
+    assert(result == objectSetHas(globalObjectSet, ptr),
+           "isObject() disagrees with the object set for %x", ptr);
+    #endif
+    return result;
 }
 
 Object *methodTable_new(Object *self, u32 size)
 {
-    Object *table = object_new(self);
+    Object *table = object_newWithData(self, methodTableDataSize(size));
     table->parent = self;
     table->methodTable = (self == NULL)?NULL:methodTableMT;
-    table->data = methodTableDataNew(size);
+    methodTableDataInit(table->table, size);
+    table->kind = methodTableObject;
     return table;
 }
 
+/* Only symbol_new() makes objects of kind symbolObject, so the kind is enough.
+ * Building with VM_DEBUG also checks the symbol table. */
 bool object_isSymbol(Object *self)
 {
-    return (stringMapGet(globalSymbolTable, self->symbol) == self);
+    if (isSmallInteger(self) || self->kind != symbolObject)
+        return false;
+    #ifdef VM_DEBUG
+    assert(stringMapGet(globalSymbolTable, self->symbol) == self,
+           "symbol '%s' is not in the symbol table", self->symbol);
+    #endif
+    return true;
 }
 
 /* A symbol's data is a pointer to the string (not necessarily unique) that was
@@ -164,6 +193,7 @@ Object *__attribute__ ((pure)) symbol_new(Object *self, String string)
         return symbol;
     symbol = object_new(self);
     symbol->data = string;
+    symbol->kind = symbolObject;
     stringMapSet(globalSymbolTable, string, symbol);
     assert(object_isSymbol(symbol), "VM error, symbol not a symbol");
     return symbol;
@@ -220,11 +250,14 @@ Object *__attribute__ ((pure)) object_bind(Object *self, Object *symbol)
      * input, since an object does not gain or lose methods after definition.
      * Special care should be taken to remove any record of self's
      * method table in the method cache if self is garbage collected. */
-    if (!object_isSymbol(symbol))
+    if (unlikely(!object_isSymbol(symbol)))
         panic("sending something not a symbol");
     if (unlikely(self == NULL))
         panic("Binding symbol '%s' to null value not implemented "
               "(can't send message to null!)", symbol->symbol);
+    // A SmallInteger has the same methods as its prototype
+    if (isSmallInteger(self))
+        self = integer32Proto;
     
     Object *methodTable = self->methodTable;
     // Check the cache
@@ -254,11 +287,108 @@ Object *__attribute__ ((pure)) object_bind(Object *self, Object *symbol)
     return method;
 }
 
+/* Each messageBC instruction has an inline cache of the methods its symbol
+ * bound to for the last few method tables it saw, which codeLoad() gives it.
+ * A site that sees more than inlineCacheWays method tables is megamorphic and
+ * goes back to object_bind(), and so to MethodCache. */
+#define inlineCacheWays 4
+
+typedef struct inlineCache
+{
+    Size entries; // more than inlineCacheWays if megamorphic
+    /* Counted in polymorphicSites already. methodCachePurge() may take the
+     * cache back down to one entry, and the site is not counted again. */
+    bool polymorphic;
+    Object *methodTables[inlineCacheWays];
+    Object *methods[inlineCacheWays];
+} InlineCache;
+
+Size inlineCacheHits, inlineCacheMisses, polymorphicSites, megamorphicSites;
+
+/* object_bind() for a messageBC instruction with the given cache */
+static Object *inlineCacheBind(InlineCache *cache, Object *self, Object *symbol)
+{
+    if (unlikely(self == NULL))
+        return object_bind(self, symbol); // does not return
+    Object *methodTable = isSmallInteger(self) ?
+        integer32Proto->methodTable : self->methodTable;
+    Size i;
+    if (likely(cache->entries <= inlineCacheWays))
+    {
+        for (i = 0; i < cache->entries; i++)
+        {
+            if (cache->methodTables[i] == methodTable)
+            {
+                inlineCacheHits++;
+                return cache->methods[i];
+            }
+        }
+    }
+    inlineCacheMisses++;
+    Object *method = object_bind(self, symbol);
+    if (method == NULL || cache->entries > inlineCacheWays)
+        return method;
+    if (cache->entries == inlineCacheWays)
+    {
+        cache->entries++;
+        megamorphicSites++;
+        return method;
+    }
+    cache->methodTables[cache->entries] = methodTable;
+    cache->methods[cache->entries] = method;
+    if (++cache->entries == 2 && !cache->polymorphic)
+    {
+        cache->polymorphic = true;
+        polymorphicSites++;
+    }
+    return method;
+}
+
+/* Called by the collector once it has marked every live object, so that no
+ * entry refers to an object about to be freed. */
+void methodCachePurge()
+{
+    Size i;
+    for (i = 0; i < sizeof(MethodCache) / sizeof(struct methodCacheEntry); i++)
+    {
+        struct methodCacheEntry *entry = MethodCache + i;
+        if ((entry->methodTable && gcDoomed(entry->methodTable)) ||
+            (entry->symbol && gcDoomed(entry->symbol)) ||
+            (entry->method && gcDoomed(entry->method)))
+        {
+            entry->methodTable = NULL;
+            entry->symbol = NULL;
+            entry->method = NULL;
+        }
+    }
+    Code *code;
+    for (code = loadedCode; code != NULL; code = code->next)
+    {
+        for (i = 0; i < code->cacheCount; i++)
+        {
+            InlineCache *cache = code->caches + i;
+            if (cache->entries > inlineCacheWays)
+                continue;
+            Size way, kept = 0;
+            for (way = 0; way < cache->entries; way++)
+            {
+                if (gcDoomed(cache->methodTables[way]) ||
+                    gcDoomed(cache->methods[way]))
+                    continue;
+                cache->methodTables[kept] = cache->methodTables[way];
+                cache->methods[kept] = cache->methods[way];
+                kept++;
+            }
+            cache->entries = kept;
+        }
+    }
+}
+
 Object *closure_newInternal(Object *self, void *function, Size argc)
 {
-    Object *new = object_new(self);
-    Closure *closure = malloc(sizeof(Closure));
-    new->data = closure;
+    Object *new = object_newWithData(self, sizeof(Closure));
+    Closure *closure = new->closure;
+    new->kind = closureObject;
     closure->argc = argc;
     closure->function = function;
     closure->type = internalClosure;
@@ -277,24 +407,29 @@ Object *newDisallowed(Object *self)
 Object *closure_new(Object *self, Object *process)
 {
     Process *processData = process->process;
-	u8 *bytecode = processData->bytecode - 1;
-	Size IP = processData->IP;	
-    Object *closure = object_new(self);
-    Closure *closureData = malloc(sizeof(Closure));
-    closure->data = closureData;
+    Instruction *block = processData->IP;
+    Object *closure = object_newWithData(self, sizeof(Closure));
+    Closure *closureData = closure->closure;
+    closure->kind = closureObject;
     Object *scope = stackTop(&processData->scopes);
     closureData->type = userDefinedClosure;
     closureData->parent = scope;
-    closureData->bytecode = bytecode + IP;
-    closureData->argc = bytecode[IP + 1];
+    closureData->code = block;
+    closureData->unit = processData->code;
+    processData->code->users++;
+    closureData->argc = block->count;
     closureData->world = scope->scope->world;
 	return closure;
 }
 
 Object *closure_whileTrue(Object *self, Object *block)
 {
+	Size pinDepth = gcPinDepth();
 	while (send(self, "eval") == trueObject)
+	{
 		send(block, "eval");
+		gcUnpinTo(pinDepth);
+	}
     return NULL;
 }
 
@@ -307,6 +442,8 @@ void methodTable_addClosure(Object *self, Object *symbol, Object *closure)
 {
     MethodTable *table = self->table;
     methodTableDataAdd(table, symbol, closure);
+    gcWriteBarrier(self, symbol);
+    gcWriteBarrier(self, closure);
 }
 
 Object *console_printTest(Object *self)
@@ -334,6 +471,107 @@ Object *console_toString(Object *self)
 	return string_new(stringProto, strdup(strBuffer));
 }
 
+/* The Memory object lets scripts sample the allocator statistics, which are
+ * cheap enough to read that they can be polled. */
+Object *memory_used(Object *self)
+{
+    MMStats stats;
+    mmStats(&stats);
+    return integer32_new(integer32Proto, stats.usedBytes);
+}
+
+Object *memory_free(Object *self)
+{
+    MMStats stats;
+    mmStats(&stats);
+    return integer32_new(integer32Proto, stats.freeBytes);
+}
+
+Object *memory_usedBlocks(Object *self)
+{
+    MMStats stats;
+    mmStats(&stats);
+    return integer32_new(integer32Proto, stats.usedBlocks);
+}
+
+Object *memory_freeBlocks(Object *self)
+{
+    MMStats stats;
+    mmStats(&stats);
+    return integer32_new(integer32Proto, stats.freeBlocks);
+}
+
+Object *memory_largestFree(Object *self)
+{
+    MMStats stats;
+    mmStats(&stats);
+    return integer32_new(integer32Proto, stats.largestFree);
+}
+
+Object *memory_allocations(Object *self)
+{
+    MMStats stats;
+    mmStats(&stats);
+    return integer32_new(integer32Proto, stats.allocations);
+}
+
+Object *memory_frees(Object *self)
+{
+    MMStats stats;
+    mmStats(&stats);
+    return integer32_new(integer32Proto, stats.frees);
+}
+
+// Element i is the number of free blocks of 2^i to 2^(i + 1) - 1 bytes
+Object *memory_histogram(Object *self)
+{
+    MMStats stats;
+    mmStats(&stats);
+    Object *counts[mmFreeListCount];
+    Size i;
+    for (i = 0; i < mmFreeListCount; i++)
+        counts[i] = integer32_new(integer32Proto, stats.histogram[i]);
+    return array_new(arrayProto, counts, mmFreeListCount);
+}
+
+Object *memory_toString(Object *self)
+{
+    char strBuffer[30];
+    sprintf(strBuffer, "<Memory at %x>", self);
+    return string_new(stringProto, strdup(strBuffer));
+}
+
+/* The Interpreter object lets scripts see how well the inline caches of
+ * message sends are doing. */
+Object *interpreter_cacheHits(Object *self)
+{
+    return integer32_new(integer32Proto, inlineCacheHits);
+}
+
+Object *interpreter_cacheMisses(Object *self)
+{
+    return integer32_new(integer32Proto, inlineCacheMisses);
+}
+
+// Sites that have seen more than one method table
+Object *interpreter_polymorphicSites(Object *self)
+{
+    return integer32_new(integer32Proto, polymorphicSites);
+}
+
+// Sites that have seen more than inlineCacheWays method tables
+Object *interpreter_megamorphicSites(Object *self)
+{
+    return integer32_new(integer32Proto, megamorphicSites);
+}
+
+Object *interpreter_toString(Object *self)
+{
+    char strBuffer[30];
+    sprintf(strBuffer, "<Interpreter at %x>", self);
+    return string_new(stringProto, strdup(strBuffer));
+}
+
 Object *returnTrue(Object *self)
 {
     return trueObject;
@@ -354,6 +592,8 @@ void object_doesNotUnderstand(Object *self, Object *symbol)
 
 Object *object_methodTable(Object *self)
 {
+    if (isSmallInteger(self))
+        return integer32Proto->methodTable;
     return self->methodTable;
 }
 
@@ -390,10 +630,14 @@ Object *process_new(Object *self)
     Object *process = object_new(self);
     Process *data = malloc(sizeof(Process));
     process->data = data;
+    process->kind = processObject;
     
     data->parent = NULL;
+    data->code = NULL;
+    data->IP = NULL;
     stackNew(&data->values);
     stackNew(&data->scopes);
+    stackNew(&data->pinned);
     // create process scope
     
     stackPush(&data->scopes, globalScope);
@@ -443,6 +687,54 @@ void consoleInstall()
     send(console, "printTest"); // should print VM CHECK: Success!
 }
 
+void memoryInstall()
+{
+    Object *memoryMT = object_send(methodTableMT, symbol("new:"), 10);
+    memoryObject = object_send(objectProto, newSymbol);
+    memoryObject->methodTable = memoryMT;
+    
+    methodTable_addClosure(memoryMT, symbol("used"),
+		closure_newInternal(closureProto, memory_used, 1));
+    methodTable_addClosure(memoryMT, symbol("free"),
+		closure_newInternal(closureProto, memory_free, 1));
+    methodTable_addClosure(memoryMT, symbol("usedBlocks"),
+		closure_newInternal(closureProto, memory_usedBlocks, 1));
+    methodTable_addClosure(memoryMT, symbol("freeBlocks"),
+		closure_newInternal(closureProto, memory_freeBlocks, 1));
+    methodTable_addClosure(memoryMT, symbol("largestFree"),
+		closure_newInternal(closureProto, memory_largestFree, 1));
+    methodTable_addClosure(memoryMT, symbol("allocations"),
+		closure_newInternal(closureProto, memory_allocations, 1));
+    methodTable_addClosure(memoryMT, symbol("frees"),
+		closure_newInternal(closureProto, memory_frees, 1));
+    methodTable_addClosure(memoryMT, symbol("histogram"),
+		closure_newInternal(closureProto, memory_histogram, 1));
+    methodTable_addClosure(memoryMT, symbol("new"),
+		closure_newInternal(closureProto, newDisallowed, 1));
+    methodTable_addClosure(memoryMT, symbol("toString"),
+		closure_newInternal(closureProto, memory_toString, 1));
+}
+
+void interpreterInstall()
+{
+    Object *interpreterMT = object_send(methodTableMT, symbol("new:"), 6);
+    interpreterObject = object_send(objectProto, newSymbol);
+    interpreterObject->methodTable = interpreterMT;
+    
+    methodTable_addClosure(interpreterMT, symbol("cacheHits"),
+		closure_newInternal(closureProto, interpreter_cacheHits, 1));
+    methodTable_addClosure(interpreterMT, symbol("cacheMisses"),
+		closure_newInternal(closureProto, interpreter_cacheMisses, 1));
+    methodTable_addClosure(interpreterMT, symbol("polymorphicSites"),
+		closure_newInternal(closureProto, interpreter_polymorphicSites, 1));
+    methodTable_addClosure(interpreterMT, symbol("megamorphicSites"),
+		closure_newInternal(closureProto, interpreter_megamorphicSites, 1));
+    methodTable_addClosure(interpreterMT, symbol("new"),
+		closure_newInternal(closureProto, newDisallowed, 1));
+    methodTable_addClosure(interpreterMT, symbol("toString"),
+		closure_newInternal(closureProto, interpreter_toString, 1));
+}
+
 /* This function must be called before any VM actions may be done. After this
  * function is called, any VM actions should be done in a thread with a
  * Process defined for it. Helper functions may be created for this later, but
@@ -452,8 +744,20 @@ void vmInstall()
 {
     /* 0. Setup global tables */
     
+    gcInstall();
+    Object **roots[] =
+    {
+        &objectProto, &objectMT, &symbolProto, &methodTableMT, &varTableProto,
+        &closureProto, &scopeProto, &trueObject, &falseObject, &worldProto,
+        &console, &memoryObject, &interpreterObject,
+    };
+    Size i;
+    for (i = 0; i < sizeof(roots) / sizeof(Object**); i++)
+        gcAddRoot(roots[i]);
     globalSymbolTable = stringMapNew(); /* string -> symbol */
+    #ifdef VM_DEBUG
     globalObjectSet = objectSetNew(16/*1024*/);
+    #endif
     
     /* 1. create and initialize methodTables */
     
@@ -539,14 +843,18 @@ void vmInstall()
     printf("D\n");
     worldInstall();
     consoleInstall(); // defines console
+    memoryInstall(); // defines memoryObject
+    interpreterInstall(); // defines interpreterObject
     traitInstall();
     
     /* 4. Make certain components accessible by defining global variables */
     
-    Size symbols_array_len = 3;
+    Size symbols_array_len = 5;
     Object *symbols_array[] =
     {
 		symbol("Console"), console,
+		symbol("Memory"), memoryObject,
+		symbol("Interpreter"), interpreterObject,
 		symbol("true"), trueObject,
 		symbol("false"), falseObject,
 	};
@@ -558,150 +866,371 @@ void vmInstall()
     
 }
 
+// Every code unit loaded, newest first
+Code *loadedCode = NULL;
+
+/* Makes room for one more element in an array with room for *space elements
+ * of width bytes, used of which are taken */
+static void *codeGrow(void *array, Size *space, Size used, Size width)
+{
+    if (used < *space)
+        return array;
+    *space *= 2;
+    return realloc(array, *space * width);
+}
+
+/* Decodes bytecode from IP up to its EOFBC into code, in one pass. The arrays
+ * grow as they fill, and the caches are only made at the end, so until then
+ * the operands that point into them hold indices instead. */
+static void codeDecode(Code *code, u8 *bytecode, Size IP, Object **symbols)
+{
+    Size instructionSpace = 64, variableSpace = 16;
+    code->instructions = kalloc(sizeof(Instruction) * instructionSpace, NULL);
+    code->variables = kalloc(sizeof(Object*) * variableSpace, NULL);
+    Stack blocks; // blockBC instructions whose endBC is yet to come
+    stackNew(&blocks);
+    Size instructionCount = 0, cacheCount = 0, variableCount = 0;
+    
+    while (true)
+    {
+        code->instructions = codeGrow(code->instructions, &instructionSpace,
+                                      instructionCount, sizeof(Instruction));
+        Instruction *instruction = code->instructions + instructionCount;
+        u8 opcode = bytecode[IP++];
+        instruction->opcode = opcode;
+        switch (opcode)
+        {
+            case integerBC:
+            case stringBC:
+            {
+                Size constant = readValue(bytecode, &IP);
+                assert(constant < code->constantCount,
+                       "malformed bytecode: no constant %i", constant);
+                instruction->literal = code->constants[constant];
+            } break;
+            case doubleBC:
+                readString(bytecode, &IP);
+                break;
+            case charBC:
+                IP++;
+                break;
+            case symbolBC:
+                instruction->literal = symbols[readValue(bytecode, &IP)];
+                break;
+            case variableBC:
+            case setBC:
+                instruction->symbol = symbols[readValue(bytecode, &IP)];
+                break;
+            case messageBC:
+                instruction->symbol = symbols[readValue(bytecode, &IP)];
+                instruction->count = readValue(bytecode, &IP);
+                instruction->cache = (InlineCache*)cacheCount++;
+                break;
+            case arrayBC:
+                instruction->count = readValue(bytecode, &IP);
+                break;
+            case blockBC:
+            {
+                Size argCount = readValue(bytecode, &IP);
+                Size varCount = readValue(bytecode, &IP);
+                instruction->count = argCount;
+                instruction->varCount = varCount;
+                instruction->variables = (Object**)variableCount;
+                instruction->end = NULL;
+                Size i;
+                for (i = 0; i < argCount + varCount; i++)
+                {
+                    code->variables = codeGrow(code->variables,
+                        &variableSpace, variableCount, sizeof(Object*));
+                    code->variables[variableCount++] =
+                        symbols[readValue(bytecode, &IP)];
+                }
+                stackPush(&blocks, (void*)instructionCount);
+            } break;
+            case endBC:
+            {
+                assert(blocks.size > 1, "malformed bytecode: unexpected end");
+                Size block = (Size)stackPop(&blocks);
+                code->instructions[block].end =
+                    (Instruction*)(instructionCount + 1);
+            } break;
+            case stopBC:
+            case cascadeBC:
+            case EOFBC:
+                break;
+            case objectBC:
+                panic("Object definitions are not implemented");
+                break;
+            default:
+                panic("invalid bytecode %x at %i", opcode, IP - 1);
+                break;
+        }
+        instructionCount++;
+        if (opcode == EOFBC)
+            break;
+    }
+    stackDel(&blocks);
+    
+    // Give back what the arrays did not fill, then turn indices into pointers
+    code->instructionCount = instructionCount;
+    code->cacheCount = cacheCount;
+    code->variableCount = variableCount;
+    code->instructions = realloc(code->instructions,
+                                 sizeof(Instruction) * instructionCount);
+    code->caches = kalloc(sizeof(InlineCache) * (cacheCount + 1), NULL);
+    memset(code->caches, 0, sizeof(InlineCache) * cacheCount);
+    code->variables = realloc(code->variables,
+                              sizeof(Object*) * (variableCount + 1));
+    Size i;
+    for (i = 0; i < instructionCount; i++)
+    {
+        Instruction *instruction = code->instructions + i;
+        if (instruction->opcode == messageBC)
+            instruction->cache = code->caches + (Size)instruction->cache;
+        else if (instruction->opcode == blockBC)
+        {
+            instruction->variables =
+                code->variables + (Size)instruction->variables;
+            if (instruction->end != NULL)
+                instruction->end =
+                    code->instructions + (Size)instruction->end;
+        }
+    }
+}
+
+/* Decodes the output of compile() into a new code unit. The bytecode is not
+ * needed after this. The code unit is used once, by the caller; closures made
+ * from it use it too, and it is freed when the last user lets go of it with
+ * codeRelease(). Closures can outlive the thread that loaded it, so nothing
+ * here belongs to that thread. */
+Code *codeLoad(u8 *bytecode)
+{
+    Size IP = 0;
+    Code *code = kalloc(sizeof(Code), NULL);
+    memset(code, 0, sizeof(Code));
+    code->users = 1;
+    
+    // Read the bytecode header defining interned symbols.
+    Size symbolCount = readValue(bytecode, &IP);
+    Object **symbols = malloc(sizeof(Object*) * (symbolCount + 1));
+    Size i;
+    for (i = 0; i < symbolCount; i++)
+    {
+        String s = readString(bytecode, &IP);
+        /* A new symbol keeps its name, which must outlive the bytecode. It
+         * outlives the code unit too, as symbols are never collected. */
+        if (stringMapGet(globalSymbolTable, s) == NULL)
+            s = strcpy(kalloc(strlen(s) + 1, NULL), s);
+        symbols[i] = symbol(s);
+    }
+    
+    /* Then the constant pool. Each constant is made once here, and each
+     * integerBC or stringBC pushes the one it refers to. */
+    Size constantCount = readValue(bytecode, &IP);
+    code->constants = kalloc(sizeof(Object*) * (constantCount + 1), NULL);
+    // From here on the collector sees the constants made so far
+    code->next = loadedCode;
+    loadedCode = code;
+    for (i = 0; i < constantCount; i++)
+    {
+        String s = readString(bytecode, &IP);
+        u8 type = s[0];
+        Object *constant = NULL;
+        if (type == integerBC)
+            constant = integer32_new(integer32Proto,
+                                     strtoul(s + 1, NULL, 10));
+        else if (type == stringBC)
+            constant = string_new(stringProto, s + 1);
+        else
+            panic("malformed bytecode: constant of type %x", type);
+        code->constants[i] = constant;
+        code->constantCount = i + 1;
+    }
+    
+    codeDecode(code, bytecode, IP, symbols);
+    
+    free(symbols);
+    return code;
+}
+
+/* Frees a code unit, which nothing may use any more. Its constants are no
+ * longer roots once it is gone. */
+void codeDel(Code *code)
+{
+    Code **link = &loadedCode;
+    while (*link != code)
+        link = &(*link)->next;
+    *link = code->next;
+    free(code->instructions);
+    free(code->caches);
+    free(code->variables);
+    free(code->constants);
+    free(code);
+}
+
+/* Lets go of a code unit, freeing it if that was its last user */
+void codeRelease(Code *code)
+{
+    assert(code->users > 0, "Code unit released too often");
+    if (--code->users == 0)
+        codeDel(code);
+}
+
+/* Instruction tracing, for debugging the interpreter. Set vmTrace to print
+ * every instruction exec() runs. */
+bool vmTrace = false;
+// How many instructions exec() has run, for benchmarks
+umax vmInstructions = 0;
+
+/* exec() is direct threaded: each instruction handler ends by jumping
+ * straight to the handler of the next opcode through dispatchTable, rather
+ * than going back around a switch. codeLoad() has checked every opcode. */
+#define dispatch()\
+({\
+    if (pinned->size > pinDepth)\
+        pinned->size = pinDepth;\
+    instruction = IP++;\
+    vmInstructions++;\
+    if (unlikely(vmTrace))\
+        printf("executing %x: %x, %s\n", instruction, instruction->opcode,\
+               bytecodes[instruction->opcode - 0x80]);\
+    goto *dispatchTable[instruction->opcode - 0x80];\
+})
+
 Object *exec(Object *closure, Object *scope)
 {
+    // indexed by opcode - 0x80
+    static void *dispatchTable[16] =
+    {
+        &&invalidInstruction,
+        &&literalInstruction, // integerBC
+        &&notImplemented, // doubleBC
+        &&literalInstruction, // stringBC
+        &&notImplemented, // charBC
+        &&literalInstruction, // symbolBC
+        &&arrayInstruction, // arrayBC
+        &&blockInstruction, // blockBC
+        &&variableInstruction, // variableBC
+        &&messageInstruction, // messageBC
+        &&stopInstruction, // stopBC
+        &&setInstruction, // setBC
+        &&endInstruction, // endBC
+        &&notImplemented, // objectBC
+        &&notImplemented, // cascadeBC
+        &&EOFInstruction, // EOFBC
+    };
     Object *process = currentProcess();
     Process *processData = process->process;
-    Object **symbols = processData->symbols;
     Stack *valueStack = &processData->values;
     Stack *scopeStack = &processData->scopes;
-    u8 *bytecode = processData->bytecode;
-    Size *IP = &processData->IP;
+    Stack *pinned = &processData->pinned;
+    // the first instruction of the closure's body
+    Instruction *IP = closure->closure->code + 1;
+    Instruction *instruction;
+    // Values below this belong to the caller; objects pinned below pinDepth
+    // were pinned by the caller (see gc.h)
+    Size stackBase = valueStack->size;
+    Size pinDepth = pinned->size;
+    // Closures made here come from the same code unit as this one
+    Code *callerCode = processData->code;
+    processData->code = closure->closure->unit;
     
     stackPush(scopeStack, scope);
+    dispatch();
     
-	while (true)
-	{
-        Size value = readValue(bytecode, IP);
-		printf("executing %2i: %x, %s\n", *IP - 1,
-		       value, bytecodes[value - 0x80]);
-		switch (value)
-		{
-			case integerBC:
-			{
-                /* The value of the integer is given as a string. */
-				String s = readString(bytecode, IP);
-				Object *integer = integer32_new(integer32Proto,
-				                                strtoul(s, NULL, 10));
-				stackPush(valueStack, integer);
-			}
-            break;
-			case doubleBC:
-                /* The value of the double is given as a string. */
-				panic("not implemented");
-            break;
-			case stringBC:
-			{
-			    String s = readString(bytecode, IP);
-			    Object *str = string_new(stringProto, s);
-			    stackPush(valueStack, str);
-			}
-            break;
-			case charBC:
-				panic("not implemented");
-            break;
-			case symbolBC:
-                /* use the symbol array to find the symbol object which has
-                 * already been created at the start of the file */
-				panic("not implemented");
-            break;
-			case arrayBC:
-            {
-                Size elementCount = readValue(bytecode, IP);
-                Object *objects[elementCount];
-                
-                Size i = elementCount;
-                while (i --> 0)
-                    objects[i] = stackPop(valueStack);
-                
-                Object *arrayNew = array_new(arrayProto,
-                                             (Object**)objects,
-                                             elementCount);
-                
-                stackPush(valueStack, arrayNew);
-            }
-            break;
-			case blockBC:
-			{
-				Object *closureNew = closure_new(closureProto, process);
-				// increment bytecode until the end of closure definition
-				while (readValue(bytecode, IP) != endBC) {}
-				stackPush(valueStack, closureNew);
-			}
-            break;
-			case variableBC:
-			{
-                /* We have found a variable, so we need to look up its value. */
-                Object *symbol = symbols[readValue(bytecode, IP)];
-                Object *value = scope_lookupVar(stackTop(scopeStack), symbol);
-				stackPush(valueStack, value);
-			}
-            break;
-            case cascadeBC:
-            {
-				panic("not implemented");
-			} break;
-			case messageBC:
-			{
-				/* argc is the number of arguments not including recipient */
-				Object *symbol = symbols[readValue(bytecode, IP)];
-				Size argc = readValue(bytecode, IP);
-                
-				Object **args = (Object**)stackPopMany(valueStack, argc + 1);
-				Object *recipient = args[0];
-			    //printf("Sending %s to %S, argc %i\n", symbol->symbol, recipient, argc);
-			    Object *method = object_bind(recipient, symbol);
-			    if (method == NULL)
-			    {
-					printf("Sent '%s' to %S, found no method\n",
-							symbol->symbol, recipient);
-					panic("null method");
-				}
-				
-				Object *scope = stackTop(scopeStack);
-				Scope *scopeData = scope->scope;
-				scopeData->IP = processData->IP;
-				scopeData->bytecode = processData->bytecode;
-                
-				Object *result = closure_withArray(method, args);
-                stackPush(valueStack, result);
-			}
-            break;
-			case stopBC: /* Clears the current stack. Possibly will cause GC? */
-				//stackPop(valueStack);
-            break;
-			case setBC:
-			{
-			    Object *symbol = symbols[readValue(bytecode, IP)];
-			    Object *value = stackPop(valueStack);
-			    scope_setVar(stackTop(scopeStack), symbol, value);
-			}
-            break;
-			case endBC: /* Returns from the current block */
-			{
-                /// todo, be smarter about handling stack underrun errors
-                
-				stackPop(scopeStack);
-				Object *scope = stackTop(scopeStack);
-				Scope *scopeData = scope->scope;
-				processData->IP = scopeData->IP;
-				processData->bytecode = scopeData->bytecode;
-			} // no break
-            case EOFBC:
-				if (valueStack->size)
-                    return stackPop(valueStack);
-                else
-                    return NULL;
-            break;
-			case objectBC: /* Define an object */
-				panic("not implemented");
-            break;
-			default:
-				panic("invalid bytecode");
-			break;
-		}
-	}
-	panic("not implemented");
+    literalInstruction:
+        stackPush(valueStack, instruction->literal);
+        dispatch();
+    arrayInstruction:
+    {
+        Size elementCount = instruction->count;
+        Object *objects[elementCount];
+        
+        // The elements stay on the stack, where the collector can
+        // see them, until the array holds them
+        memcpy(objects, stackAt(valueStack, elementCount - 1),
+               elementCount * sizeof(Object*));
+        Object *arrayNew = array_new(arrayProto,
+                                     (Object**)objects,
+                                     elementCount);
+        stackPopMany(valueStack, elementCount);
+        
+        stackPush(valueStack, arrayNew);
+        dispatch();
+    }
+    blockInstruction:
+    {
+        processData->IP = instruction;
+        Object *closureNew = closure_new(closureProto, process);
+        // continue after the end of closure definition
+        IP = instruction->end;
+        stackPush(valueStack, closureNew);
+        dispatch();
+    }
+    variableInstruction:
+    {
+        /* We have found a variable, so we need to look up its value. */
+        Object *value = scope_lookupVar(stackTop(scopeStack),
+                                        instruction->symbol);
+        stackPush(valueStack, value);
+        dispatch();
+    }
+    messageInstruction:
+    {
+        /* argc is the number of arguments not including recipient */
+        Object *symbol = instruction->symbol;
+        Size argc = instruction->count;
+        
+        // The arguments stay on the stack, where the collector can see
+        // them, until the method returns
+        Object *args[argc + 1];
+        memcpy(args, stackAt(valueStack, argc),
+               (argc + 1) * sizeof(Object*));
+        Object *recipient = args[0];
+        //printf("Sending %s to %S, argc %i\n", symbol->symbol, recipient, argc);
+        Object *method = inlineCacheBind(instruction->cache, recipient, symbol);
+        if (method == NULL)
+        {
+            printf("Sent '%s' to %S, found no method\n",
+                    symbol->symbol, recipient);
+            panic("null method");
+        }
+        
+        Object *result = closure_withArray(method, args);
+        stackPopMany(valueStack, argc + 1);
+        stackPush(valueStack, result);
+        dispatch();
+    }
+    stopInstruction: /* Clears the current stack */
+        stackPopMany(valueStack, valueStack->size - stackBase);
+        dispatch();
+    setInstruction:
+    {
+        Object *value = stackPop(valueStack);
+        scope_setVar(stackTop(scopeStack), instruction->symbol, value);
+        dispatch();
+    }
+    endInstruction: /* Returns from the current block */
+        /// todo, be smarter about handling stack underrun errors
+        stackPop(scopeStack);
+        // fall through
+    EOFInstruction:
+    {
+        Object *result = NULL;
+        if (valueStack->size > stackBase)
+            result = stackPop(valueStack);
+        stackPopMany(valueStack, valueStack->size - stackBase);
+        // keep the result alive for the caller
+        gcUnpinTo(pinDepth);
+        gcPin(result);
+        processData->code = callerCode;
+        return result;
+    }
+    notImplemented:
+        panic("not implemented");
+    invalidInstruction:
+        panic("invalid bytecode");
+    return NULL;
 }
 
 Object *interpret(Object *closure, va_list args)
@@ -710,47 +1239,26 @@ Object *interpret(Object *closure, va_list args)
     assert(process != NULL, "Create a new process first.");
     
     Process *processData = process->process;
-    Object **symbols = processData->symbols;
-    Stack *valueStack = &processData->values;
     Stack *scopeStack = &processData->scopes;
-    
-    u8 *bytecode = processData->bytecode;
-    Size *IP = &processData->IP;
     Closure *closureData;
     
     if (closure == NULL) // new file
     {
-        // Read the bytecode header defining interned symbols.
-        Size symbolCount = readValue(bytecode, IP);
-        if (symbolCount > 0)
-        {
-			// This is a process-wide symbol list unique to the given bytecode.
-			symbols = malloc(sizeof(Object*) * symbolCount);
-			Size i;
-			for (i = 0; i < symbolCount; i++)
-			{
-				String s = readString(bytecode, IP);
-				symbols[i] = symbol(s);
-			}
-			processData->symbols = symbols;
-		}
+        processData->IP = processData->code->instructions;
 		closure = closure_new(closureProto, process);
 		closureData = closure->closure;
         closureData->world = globalScope->scope->world;
     }
     else
-    {
 		closureData = closure->closure;
-		processData->IP = closureData->bytecode - processData->bytecode;
-	}
     
-    assert(readValue(bytecode, IP) == blockBC,
-			"Expected block: malformed bytecode (IP=%i)", *IP-1);
+    Instruction *block = closureData->code;
+    assert(block->opcode == blockBC, "Expected block: malformed bytecode");
     
     // We've just begun executing a block, so create the scope for that block.
     Object *scope;
-    Size argCount = readValue(bytecode, IP);
-    Size varCount = readValue(bytecode, IP);
+    Size argCount = block->count;
+    Size varCount = block->varCount;
     Size symbolCount = argCount + varCount;
     
     if (symbolCount > 0)
@@ -760,11 +1268,10 @@ Object *interpret(Object *closure, va_list args)
         Size i;
         for (i = 0; i < symbolCount; i++)
         {
-            Size value = readValue(bytecode, IP);
-            localSymbols[2 * i] = symbols[value];
+            localSymbols[2 * i] = block->variables[i];
             // values are supplied only for args, not vars.
-            if (i < argCount)
-                localSymbols[2 * i + 1] = va_arg(args, Object*);
+            localSymbols[2 * i + 1] = (i < argCount) ?
+                va_arg(args, Object*) : NULL;
         }
         scope = scope_new(scopeProto, process, closureData->parent,
                           stackTop(scopeStack), closureData->world,
@@ -780,6 +1287,7 @@ Object *interpret(Object *closure, va_list args)
     
     Scope *scopeData = scope->scope;
     scopeData->closure = closure;
+    gcWriteBarrier(scope, closure);
     
     return exec(closure, scope);
 }
@@ -792,7 +1300,15 @@ void interpretBytecode(u8 *bytecode)
 	if (process == NULL) // create new process
 		process = process_new(objectProto);
 	Process *processData = process->process;
-	processData->bytecode = bytecode;
-	processData->IP = 0;
+	Size scopeDepth = processData->scopes.size;
+	// Whatever loading and running the code pins is done with afterwards
+	Size pinDepth = gcPinDepth();
+	Code *code = codeLoad(bytecode);
+	processData->code = code;
 	interpret(NULL, NULL);
+	processData->code = NULL;
+	gcUnpinTo(pinDepth);
+	// The EOFBC leaves the scope of the code on the stack; drop it
+	stackPopMany(&processData->scopes, processData->scopes.size - scopeDepth);
+	codeRelease(code);
 }
@@ -0,0 +1,102 @@
+/*  Copyright (C) 2014 Xander Vedejas <xvedejas@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <main.h>
+#include <vm.h>
+#include <parser.h>
+#include <threading.h>
+#include <vm_tests.h>
+#include <gc.h>
+#include <mm.h>
+#include <Scope.h>
+
+/* Runs a script that spends its time sending messages in a loop, and reports
+ * how many bytecode instructions exec() ran per second, and how many cycles
+ * each took on average. Spawn this as its own thread, since it needs a
+ * process, and only once the timer is running, since the timer ticks are what
+ * show the figures are sane. */
+ThreadFunc vm_dispatch_benchmark()
+{
+    String input = "(1 to: 100000) do: {:i i * 2 + 1}";
+    u8 *bytecode = compile(input);
+    bool trace = vmTrace;
+    vmTrace = false;
+    umax instructions = vmInstructions;
+    umax ticks = timerTicks;
+    umax start = rdtsc();
+    interpretBytecode(bytecode);
+    umax cycles = rdtsc() - start;
+    ticks = timerTicks - ticks;
+    instructions = vmInstructions - instructions;
+    vmTrace = trace;
+    // There is no 64-bit division, so scale the cycles down to 32 bits
+    u32 perSecond = ticks ? (u32)instructions / (u32)ticks * systemClockFreq
+                          : 0;
+    umax scaled = instructions;
+    while (cycles > u32max)
+    {
+        cycles >>= 1;
+        scaled >>= 1;
+    }
+    printf("dispatch: %i instructions in %i ticks, %i per second, "
+        "average %i cycles\n", (u32)instructions, (u32)ticks, perSecond,
+        scaled ? (u32)cycles / (u32)scaled : 0);
+    if (!ticks)
+        printf("dispatch: the timer is not running, so these figures cannot "
+            "be trusted\n");
+}
+
+/* Makes a scope with a variable defined in it, and lets it die */
+static Object *gcDeadScope(Object *process, Object *name)
+{
+    Size pinDepth = gcPinDepth();
+    Object *symbols[] = {name, NULL};
+    Object *scope = scope_new(scopeProto, process, globalScope, globalScope,
+                              globalScope->scope->world, 0, 1, symbols);
+    scope_setVar(scope, name, smallIntegerNew(1));
+    gcUnpinTo(pinDepth);
+    return scope;
+}
+
+/* Has the collector free a dead scope with full heap verification on, and
+ * checks that the scope is gone and that all the memory it used was given
+ * back. The first scope made takes whatever memory only the first one needs,
+ * so the second is the one measured. Spawn this as its own thread, since it
+ * needs a process, and with no other process running, since the collector
+ * only runs then. */
+ThreadFunc gc_scope_test()
+{
+    MMVerifyLevel level = mmVerifyLevel;
+    mmVerifyLevel = mmVerifyFull;
+    Object *process = process_new(objectProto);
+    Object *name = symbol("a");
+    gcDeadScope(process, name);
+    gcCollect();
+    MMStats before, after;
+    mmStats(&before);
+    Object *scope = gcDeadScope(process, name);
+    gcCollect();
+    sweep();
+    mmStats(&after);
+    mmVerifyLevel = level;
+    if (gcIsObject(scope))
+        panic("failed test: dead scope was not collected\n");
+    if (after.usedBytes != before.usedBytes ||
+        after.usedBlocks != before.usedBlocks)
+        panic("failed test: used %x bytes in %i blocks, then %x in %i\n",
+            before.usedBytes, before.usedBlocks, after.usedBytes,
+            after.usedBlocks);
+    printf("test passed!\n");
+}